@@ -10,6 +10,7 @@
 #include <stdarg.h>
 
 #define MAX_TEXT 128
+#define THREAD_STACK_SIZE (64 * 1024) // поклонникам хватает малого стека (по умолчанию 8 МиБ)
 
 // предложение (валентинка) от поклонника
 typedef struct {
@@ -218,9 +219,16 @@ int main(int argc, char **argv) {
     atomic_init(&gWinnerId, -1);
     atomic_init(&gBestScore, -1);
 
+    // атрибуты потоков: уменьшенный стек, чтобы 1000 потоков не резервировали ~8 ГиБ
+    pthread_attr_t attr;
+    int rc = pthread_attr_init(&attr);
+    die_pthread(rc, "pthread_attr_init");
+    rc = pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    die_pthread(rc, "pthread_attr_setstacksize");
+
     // запускаем серверный поток
     pthread_t server;
-    int rc = pthread_create(&server, NULL, girl_thread, NULL);
+    rc = pthread_create(&server, &attr, girl_thread, NULL);
     die_pthread(rc, "pthread_create(server)");
 
     // запускаем клиентские потоки
@@ -230,9 +238,10 @@ int main(int argc, char **argv) {
 
     for (int i = 0; i < gN; ++i) {
         args[i].fan_id = i;
-        rc = pthread_create(&clients[i], NULL, fan_thread, &args[i]);
+        rc = pthread_create(&clients[i], &attr, fan_thread, &args[i]);
         die_pthread(rc, "pthread_create(client)");
     }
+    pthread_attr_destroy(&attr);
 
     // ждём завершения клиентов
     for (int i = 0; i < gN; ++i) {
@@ -11,6 +11,7 @@
 #include <signal.h>
 
 #define MAX_TEXT 128
+#define THREAD_STACK_SIZE (64 * 1024) // поклонникам хватает малого стека (по умолчанию 8 МиБ)
 
 // предложение (валентинка) от поклонника
 typedef struct {
@@ -273,9 +274,14 @@ int main(int argc, char **argv) {
 
     safe_print("[MAIN] Старт: N=%d, SEED=%u (Ctrl+C для прерывания)\n", gN, base_seed);
 
+    // атрибуты потоков: уменьшенный стек
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
     // запуск сервера
     pthread_t server;
-    pthread_create(&server, NULL, girl_thread, NULL);
+    pthread_create(&server, &attr, girl_thread, NULL);
 
     // запуск клиентов
     pthread_t *clients = calloc(gN, sizeof(pthread_t));
@@ -284,8 +290,9 @@ int main(int argc, char **argv) {
     for (int i = 0; i < gN; ++i) {
         args[i].fan_id = i;
         args[i].base_seed = base_seed;
-        pthread_create(&clients[i], NULL, fan_thread, &args[i]);
+        pthread_create(&clients[i], &attr, fan_thread, &args[i]);
     }
+    pthread_attr_destroy(&attr);
 
     for (int i = 0; i < gN; ++i) pthread_join(clients[i], NULL);
     pthread_join(server, NULL);
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Сверка движков (раздел 45 README): версии 8 и 9-10 собираются и играют --check
+# на одной сетке сценариев. Внутри движка режимы сверяет сам --check (код выхода 3),
+# а здесь сравниваются движки между собой: для каждого (N, SEED) победитель,
+# best_score и дайджест ответов всем поклонникам должны совпасть во всех режимах
+# обоих движков.
+#
+# Запуск из любого каталога: sh 8/check_engines.sh [ключи --check, например -s 5 или -n 300]
+# Параметры окружения: CC (компилятор, по умолчанию gcc), KEEP=1 — не удалять каталог
+# со сборкой и таблицами.
+
+cd "$(dirname "$0")/.." || exit 1
+CC=${CC:-gcc}
+WORK=$(mktemp -d) || exit 1
+
+for engine in 8 9-10; do
+    $CC -std=c17 -O2 -pthread "$engine/main.c" -o "$WORK/main_$engine" || exit 1
+done
+
+failures=0
+for engine in 8 9-10; do
+    "$WORK/main_$engine" --check "$@" >"$WORK/table_$engine" 2>"$WORK/err_$engine"
+    rc=$?
+    if [ "$rc" -ne 0 ]; then
+        echo "[ENGINES] FAIL engine=$engine: --check exit code $rc"
+        cat "$WORK/err_$engine"
+        failures=$((failures + 1))
+    fi
+    # N, SEED, winner, best_score, digest без режима и времени: по строке на сценарий,
+    # если режимы движка согласны между собой
+    grep -v '^#' "$WORK/table_$engine" | cut -f1,2,4,5,6 | sort -u -n -k1,1 -k2,2 >"$WORK/results_$engine"
+done
+
+rows=$(wc -l <"$WORK/results_8")
+if [ "$rows" -eq 0 ]; then
+    echo "[ENGINES] FAIL: engine 8 printed no scenarios"
+    failures=$((failures + 1))
+elif ! diff "$WORK/results_8" "$WORK/results_9-10" >"$WORK/diff"; then
+    echo "[ENGINES] FAIL: results differ (< engine 8, > engine 9-10):"
+    cat "$WORK/diff"
+    failures=$((failures + 1))
+fi
+
+echo "[ENGINES] scenarios=$rows failures=$failures"
+if [ "$failures" -ne 0 ] || [ "${KEEP:-0}" = 1 ]; then
+    echo "[ENGINES] builds and tables kept in $WORK"
+else
+    rm -rf "$WORK"
+fi
+[ "$failures" -eq 0 ]
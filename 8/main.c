@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,21 @@
 #include <sched.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 
 #define MAX_TEXT 128
 
@@ -18,6 +34,7 @@ typedef struct {
     int fan_id;
     int score;                 // "привлекательность" предложения
     char text[MAX_TEXT];       // описание вечера
+    uint64_t lts;              // логическое время отправки (--ordered-log)
 } Offer;
 
 // ответ студентки каждому поклоннику
@@ -25,12 +42,40 @@ typedef struct {
     int accepted;              // 1 = да, 0 = нет
     int winner_id;             // кто победил (для общего сведения)
     int best_score;            // лучший балл (для общего сведения)
+    int late;                  // приём закрыт раньше: LATE_DEADLINE или LATE_EARLY
+    uint64_t lts;              // логическое время рассылки (--ordered-log)
+    uint64_t sent_ns;          // момент публикации (--bench: задержка пробуждения)
 } Reply;
 
+// атрибуты предложений по столбцам (структура массивов): сервер оценивает их
+// одним векторным проходом (rate_offers), k — номер ящика
+typedef struct {
+    int *score;                // привлекательность, 1..100
+    int *cost;                 // стоимость вечера, 1..100
+    int *duration;             // длительность, 1..6 ч
+    int *idea;                 // категория идеи (индекс в kIdeas)
+    int *rating;               // взвешенная сумма (заполняет сервер)
+} OfferCols;
+
 
 static int gN = 0;             // количество поклонников (кол-во клиентских потоков)
 static Offer *gOffers = NULL;  // массив предложений: gOffers[i] — предложение i-го поклонника
 static Reply *gReplies = NULL; // массив ответов: gReplies[i] — ответ i-му поклоннику
+static OfferCols gCols;        // атрибуты предложений: столбец[i] — от i-го поклонника
+
+// Многокритериальная оценка: рейтинг предложения — взвешенная сумма атрибутов,
+// веса задаются в конфиге (-c) строками W_SCORE=, W_COST=, W_DURATION=, W_IDEA=, FAV_IDEA=.
+// По умолчанию W_SCORE=1, остальные 0 — рейтинг равен score, как раньше.
+#define WEIGHT_LIMIT 1000             // |вес| <= WEIGHT_LIMIT, чтобы сумма не переполнила int
+
+typedef struct {
+    int score, cost, duration, idea;  // веса атрибутов (idea — бонус за любимую категорию)
+    int fav_idea;                     // любимая категория идеи студентки
+} Weights;
+
+static Weights gWeights = { 1, 0, 0, 0, 0 };
+static int gMultiCriteria = 0;        // веса отличаются от умолчания
+static int gRankBench = 0;            // --rank-bench M: замер ядра оценки на M предложениях
 
 // Флаги (активное ожидание)
 // submitted[i] == 1, когда поклонник i отправил предложение
@@ -42,16 +87,256 @@ static atomic_int *gReplied   = NULL;
 static atomic_int gWinnerId   = -1;
 static atomic_int gBestScore  = -1;
 
+// Сбор с дедлайном (--deadline MS): через MS мс после начала ожидания студентка
+// выбирает среди уже пришедших предложений, а опоздавшим сразу отвечает "слишком поздно".
+// Кто успел, решает CAS по флагу отправки: поклонник 0→SUBMIT_DONE, сервер 0→SUBMIT_LATE.
+enum { SUBMIT_PENDING = 0, SUBMIT_DONE = 1, SUBMIT_LATE = 2 };
+
+static int gDeadlineMs = 0;           // 0 = ждать всех
+static int gLateCount = 0;            // сколько поклонников не успели (пишет сервер)
+
+// Досрочное решение (--early first|lowest): как только приходит предложение с
+// максимально возможным score, студентка закрывает приём тем же CAS, что и по дедлайну,
+// и сразу отвечает всем — и ждущим ответа, и ещё думающим (их будит gReleaseFd).
+// first — побеждает первый пришедший с максимумом, lowest — наименьший id среди пришедших.
+#define SCORE_MIN 1
+#define SCORE_MAX 100
+
+enum { EARLY_OFF = 0, EARLY_FIRST, EARLY_LOWEST };
+enum { LATE_DEADLINE = 1, LATE_EARLY = 2 };   // причина закрытия приёма (Reply.late)
+
+static int gEarly = EARLY_OFF;
+static atomic_int gEarlyId = -1;      // первый поклонник, отправивший SCORE_MAX
+static int gReleaseFd = -1;           // eventfd: становится читаемым при досрочном решении
+static int gClosedBy = 0;             // чем закрыт приём (пишет сервер, читает main после join)
+static struct timespec gDecidedAt;    // момент досрочного решения
+
 // Флаг запроса на корректное завершение (SIGINT)
 // Если пользователь нажал Ctrl+C — выставляем gStop=1 и завершаемся корректно
 static atomic_int gStop       = 0;
 
+// SIGINT заблокирован во всех потоках и читается через signalfd отдельным потоком
+// завершения. Он выставляет gStop и взводит gStopFd (eventfd), на котором с
+// таймаутом "спят" обдумывающие поклонники — поэтому они просыпаются сразу.
+/*
+ * Профиль упорядочивания памяти (--order):
+ *  seqcst — как раньше: atomic_load/atomic_store (seq_cst) на каждый опрос и публикацию;
+ *  acqrel — публикация с release, опрос в цикле ожидания relaxed-загрузкой и один
+ *           acquire-барьер после того, как ожидание завершилось.
+ * На x86 это убирает xchg/mfence у каждой публикации, на ARM — барьер у каждого опроса.
+ */
+enum { ORDER_SEQ_CST = 0, ORDER_ACQ_REL };
+
+static int gOrder = ORDER_SEQ_CST;
+
+// ThreadSanitizer не моделирует отдельные барьеры (atomic_thread_fence), поэтому
+// в сборке с -fsanitize=thread опрос делается acquire-загрузкой — та же пара release/acquire
+#ifdef __SANITIZE_THREAD__
+#define POLL_ORDER memory_order_acquire
+#else
+#define POLL_ORDER memory_order_relaxed
+#endif
+
+static int gStopFd = -1;               // eventfd: становится читаемым при остановке
+static int gQuitFd = -1;               // eventfd: main просит поток завершения выйти
+static struct timespec gSigintAt;      // момент получения SIGINT
+
 // Печать синхронизируем мьютексом, чтобы строки не перемешивались
 static pthread_mutex_t gPrintLock = PTHREAD_MUTEX_INITIALIZER;
 
 // Лог-файл (8 баллов): дублируем вывод в файл
 static FILE *gLogFile = NULL;
 
+// Шардированный режим (--servers S): поклонники распределяются по S серверам
+// по хешу id, каждый сервер выбирает локального победителя, затем итоговое слияние.
+// Счётчик прибытия и эпоха ответа у каждого шарда свои и лежат в разных кэш-линиях,
+// чтобы серверы не мешали друг другу.
+#define MAX_SERVERS 64
+
+typedef struct {
+    _Alignas(64) atomic_int arrived;     // сколько поклонников шарда отправили предложение
+    _Alignas(64) atomic_int reply_epoch; // != 0, когда шарду разосланы ответы
+    int id;                              // номер шарда
+    int count;                           // число поклонников в шарде
+    int *fans;                           // id поклонников шарда (по возрастанию)
+    int best_id;                         // локальный победитель (-1, если шард пуст)
+    int best_score;
+    uint64_t lts;                        // логические часы шарда к моменту слияния
+    int cpu;                             // ядро сервера шарда
+    Offer *offers;                       // почтовые ящики шарда: offers[k] — от fans[k]
+    OfferCols cols;                      // атрибуты предложений шарда по столбцам
+    Reply *replies;                      // replies[k] — ответ fans[k]
+} Shard;
+
+static int gServers = 1;              // число серверов (1 = обычный режим)
+static Shard *gShards = NULL;         // массив шардов (только при gServers > 1)
+static int *gShardOf = NULL;          // gShardOf[i] — шард поклонника i
+static int *gSlotOf = NULL;           // gSlotOf[i] — номер ящика поклонника i в своём шарде
+static atomic_int gShardsReady = 0;   // сколько серверов шардов разместили свои ящики
+static atomic_int gShardsDone = 0;    // сколько шардов выбрали локального победителя
+static atomic_int gMerged = 0;        // итоговое слияние выполнено
+static uint64_t gMergedLts = 0;       // логическое время слияния (видно после gMerged)
+
+// Комбинирующее дерево прибытия (--tree K): поклонники приходят в листья по K штук,
+// последний пришедший в узел поднимается к родителю, неся частичный максимум.
+// Сервер ждёт один флаг корня, победитель к этому моменту уже посчитан.
+#define TREE_MIN_FANIN 4
+#define TREE_MAX_FANIN 8
+
+typedef struct {
+    _Alignas(64) atomic_int arrived;   // сколько детей уже пришли в узел
+    atomic_llong best;                 // частичный максимум (см. tree_key)
+    int expected;                      // число детей узла
+    int parent;                        // индекс родителя (-1 у корня)
+} TreeNode;
+
+static int gTreeFanin = 0;            // 0 = дерево выключено
+static TreeNode *gTree = NULL;        // узлы по уровням: сначала листья, корень последним
+static int gTreeRoot = 0;             // индекс корня
+static atomic_int gTreeDone = 0;      // корень собран — все валентинки получены
+
+// Размещение потоков по ядрам (--pin):
+//  none  — серверы шардов на разных ядрах, остальные потоки мигрируют свободно;
+//  cores — сервер(ы) на выделенных ядрах, поклонники по кругу на остальных;
+//  numa  — то же, но серверы разнесены по NUMA-узлам, а поклонники шарда
+//          размещаются на узле своего сервера.
+// Ящики шарда выделяет и впервые трогает сам сервер шарда уже на своём ядре,
+// поэтому страницы попадают на его локальный узел (first-touch).
+enum { PIN_NONE = 0, PIN_CORES, PIN_NUMA };
+
+static int gPinMode = PIN_NONE;
+static cpu_set_t gAllowedCpus;        // исходная маска ядер процесса
+static int gCpuCount = 0;             // доступные процессу ядра
+static int *gCpus = NULL;             // их номера
+static int *gCpuNode = NULL;          // NUMA-узел каждого доступного ядра
+static int gNodeCount = 1;
+static int gServerCpu[MAX_SERVERS];   // индекс (в gCpus) ядра каждого сервера
+static unsigned char *gCpuReserved = NULL; // ядро занято сервером
+
+// Замеры (--bench): сводка по времени и переключениям контекста в stderr при выходе
+static int gBench = 0;
+static struct timespec gBenchStart;
+static double gGenMs = 0;                   // генерация параметров, сумма по раундам
+static struct timespec gJoinedAt;           // все потоки последнего раунда завершены
+
+// Атрибуты потоков (--stack, --guard, --mlock): поклонникам нужно несколько сотен
+// байт стека, а стек по умолчанию (обычно 8 МиБ) на 1000 потоков резервирует ~8 ГиБ
+#define DEFAULT_STACK_KB 64
+
+static size_t gStackKb = DEFAULT_STACK_KB;  // 0 = системный размер стека
+static size_t gGuardKb = (size_t)-1;        // -1 = системный размер защитной зоны
+static int gMlock = 0;                      // закрепить память процесса в RAM
+static pthread_attr_t gThreadAttr;         // атрибуты потоков, создаваемых из main
+static char gMemAtPeak[128];                // VSZ/RSS сразу после запуска всех потоков
+
+// Параллельный запуск (--launchers L): поклонников создают L потоков-запускальщиков,
+// а стартовый шлюз отпускает всех поклонников одновременно, когда запущены все N.
+// Шлюз — разовая точка старта, а не часть протокола, поэтому на мьютексе и condvar.
+#define MAX_LAUNCHERS 64
+
+static int gLaunchers = 0;                  // 0 = последовательный запуск из main
+static atomic_int gRunning = 0;             // сколько поклонников уже начали работу
+static struct timespec gAllRunningAt;       // момент, когда запустился последний поклонник
+static pthread_mutex_t gGateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gGateCond = PTHREAD_COND_INITIALIZER;
+static int gGateOpen = 0;
+
+// Счётчики выполнения (--stats, --metrics FILE, снимок по SIGUSR1):
+// только relaxed-инкременты без блокировок, каждый счётчик на своей кэш-линии
+typedef struct {
+    _Alignas(64) atomic_ullong submitted;    // отправлено предложений
+    _Alignas(64) atomic_ullong replied;      // получено ответов
+    _Alignas(64) atomic_ullong spins;        // неудачных проверок в циклах активного ожидания
+    _Alignas(64) atomic_ullong yields;       // вызовов sched_yield
+    _Alignas(64) atomic_ullong cond_waits;   // ожиданий на условной переменной (стартовый шлюз)
+    _Alignas(64) atomic_ullong timed_waits;  // ожиданий poll с таймаутом (обдумывание, выбор)
+    _Alignas(64) atomic_ullong futex_waits;  // засыпаний на futex в ожидании ответа (--wait futex)
+    _Alignas(64) atomic_ullong log_lines;    // строк лога
+    _Alignas(64) atomic_ullong snapshots;    // снимков по SIGUSR1
+    _Alignas(64) atomic_ullong rounds;       // сыгранных раундов
+    _Alignas(64) atomic_ullong reloads;      // принятых перечитываний конфига
+} Stats;
+
+static Stats gStats;
+static atomic_int gStatsN = 0;               // N текущего раунда (main меняет его между раундами)
+static int gStatsSummary = 0;                // --stats: сводка счётчиков в stderr при выходе
+static const char *gMetricsPath = NULL;      // --metrics FILE: снимки в формате Prometheus
+
+static void stat_inc(atomic_ullong *c) {
+    atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+}
+
+/*
+ * Упорядоченный лог (--ordered-log): каждый поток пишет строки в свой буфер
+ * без блокировок, а main при выходе сливает буферы по (логическое время, источник).
+ * Логическое время — часы Лэмпорта: +1 на каждую строку, предложение и ответ
+ * несут метку отправителя, получатель сдвигает свои часы до max(свои, метка).
+ * Порядок строк тогда зависит только от SEED, а не от того, кто раньше взял мьютекс.
+ * Источник: main, затем серверы по номеру, затем поклонники по id.
+ */
+#define LOG_SRC_MAIN   (-MAX_SERVERS - 1)
+#define LOG_SRC_SERVER (-MAX_SERVERS)        // + номер шарда
+
+// Строка в буфере хранится неотформатированной: формат (литерал вызова) и сырые
+// аргументы; строки %s копируются в text. Форматирование — только в стоке:
+// при слиянии или в потоке-стоке (см. log_sink_thread).
+typedef union {
+    long long i;                 // %d, %u, %c (со знаком или без — по спецификатору)
+    double f;                    // %f
+    size_t s;                    // %s: смещение копии в text
+} LogArg;
+
+typedef struct {
+    uint64_t ts;                 // логическое время строки
+    const char *fmt;
+    size_t arg;                  // первый аргумент строки в args
+} LogEntry;
+
+typedef struct LogBuf {
+    int src;                     // источник (LOG_SRC_* или id поклонника)
+    char *text;                  // копии строковых аргументов
+    size_t text_len, text_cap;
+    LogArg *args;
+    size_t args_len, args_cap;
+    LogEntry *ent;
+    size_t count, cap;
+    struct LogBuf *next;         // список всех буферов (добавление CAS-ом)
+} LogBuf;
+
+static int gOrderedLog = 0;
+
+/*
+ * Уровни лога (--quiet, --log LEVEL, LOG_LEVEL= в конфиге): ничего, итоги main,
+ * + серверы, + события поклонников (по умолчанию), + отладочные строки.
+ * Каждая строка пишется через LOG(уровень, ...): выключенный уровень стоит одной
+ * проверки, аргументы при этом не вычисляются. Уровни выше LOG_MAX_LEVEL
+ * вырезаются при сборке (-DLOG_MAX_LEVEL=0 — только итоги): условие становится
+ * константой, и компилятор убирает вызов целиком.
+ */
+enum { LOG_QUIET = -1, LOG_MAIN = 0, LOG_SERVER, LOG_FANS, LOG_DEBUG };
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 3                      // LOG_DEBUG
+#endif
+#define LOG_ON(lvl) ((lvl) <= LOG_MAX_LEVEL && (lvl) <= gLogLevel)
+#define LOG(lvl, ...) do { if (LOG_ON(lvl)) safe_print(__VA_ARGS__); } while (0)
+#define LOG_LINE_MAX 1024                    // длиннее — обрезается с меткой LOG_TRUNC_MARK
+#define LOG_TRUNC_MARK " [...]\n"
+
+static int gLogLevel = LOG_FANS;
+static _Atomic(LogBuf*) gLogBufs = NULL;
+static uint64_t gSpawnClock = 0;             // часы main в момент запуска потоков
+static _Thread_local LogBuf *tLog = NULL;
+static _Thread_local uint64_t tClock = 0;
+static _Thread_local int tSrc = LOG_SRC_MAIN;
+
+// отдать квант в цикле активного ожидания (с подсчётом)
+static void spin_yield(void) {
+    stat_inc(&gStats.spins);
+    stat_inc(&gStats.yields);
+    sched_yield();
+}
+
 
 static void die_pthread(int rc, const char *where) {
     // единая точка выхода при ошибках pthread-ов
@@ -66,200 +351,2838 @@ static void die_errno(const char *where) {
     exit(1);
 }
 
+// поток начинает с часами main на момент запуска (создание потока — тоже сообщение)
+static void log_thread_init(int src) {
+    tSrc = src;
+    tClock = gSpawnClock;
+}
+
+// метка сообщения: отправка и строка о ней — одно событие,
+// поэтому метка равна времени следующей строки отправителя
+static uint64_t log_stamp(void) {
+    return tClock + 1;
+}
+
+// получение сообщения с меткой ts
+static void log_recv(uint64_t ts) {
+    if (ts > tClock) tClock = ts;
+}
+
+static void *xrealloc(void *p, size_t size) {
+    void *q = realloc(p, size);
+    if (!q) die_errno("realloc(log)");
+    return q;
+}
+
+// разбор спецификатора после '%': флаги, ширина, точность, длина (h, l, ll, z);
+// возвращает указатель за ним, в *conv — символ преобразования, в *lng — число 'l' (z = 1)
+static const char *log_spec(const char *p, char *conv, int *lng) {
+    while (*p && strchr("-+ #0", *p)) ++p;
+    while (*p >= '0' && *p <= '9') ++p;
+    if (*p == '.') {
+        ++p;
+        while (*p >= '0' && *p <= '9') ++p;
+    }
+    *lng = 0;
+    while (*p == 'h' || *p == 'l' || *p == 'z') {
+        if (*p != 'h') ++*lng;
+        ++p;
+    }
+    *conv = *p;
+    return *p ? p + 1 : p;
+}
+
+static void *log_grow(void *p, size_t *cap, size_t need, size_t elem, size_t first) {
+    if (need <= *cap) return p;
+    size_t c = *cap ? *cap : first;
+    while (c < need) c *= 2;
+    *cap = c;
+    return xrealloc(p, c * elem);
+}
+
+// строка в буфер b без форматирования: формат и аргументы (строки %s копируются)
+static void log_capture(LogBuf *b, uint64_t ts, const char *fmt, va_list ap) {
+    b->ent = (LogEntry*)log_grow(b->ent, &b->cap, b->count + 1, sizeof(LogEntry), 16);
+    b->ent[b->count++] = (LogEntry){ ts, fmt, b->args_len };
+
+    for (const char *p = fmt; (p = strchr(p, '%')) != NULL;) {
+        char conv;
+        int lng;
+        p = log_spec(p + 1, &conv, &lng);
+        if (conv == '%' || !conv) continue;
+
+        b->args = (LogArg*)log_grow(b->args, &b->args_cap, b->args_len + 1, sizeof(LogArg), 64);
+        LogArg *a = &b->args[b->args_len++];
+        if (conv == 's') {
+            const char *str = va_arg(ap, const char*);
+            size_t len = strlen(str) + 1;
+            b->text = (char*)log_grow(b->text, &b->text_cap, b->text_len + len, 1, 4096);
+            memcpy(b->text + b->text_len, str, len);
+            a->s = b->text_len;
+            b->text_len += len;
+        } else if (strchr("feg", conv)) {
+            a->f = va_arg(ap, double);
+        } else if (strchr("uxX", conv)) {
+            a->i = (long long)(lng >= 2 ? va_arg(ap, unsigned long long) :
+                               lng == 1 ? va_arg(ap, unsigned long) : va_arg(ap, unsigned));
+        } else {
+            a->i = lng >= 2 ? va_arg(ap, long long) : lng == 1 ? va_arg(ap, long) : va_arg(ap, int);
+        }
+    }
+}
+
+// строка в буфер своего потока (--ordered-log): без мьютекса; буфер создаётся при первой записи
+static void log_append(const char *fmt, va_list ap) {
+    LogBuf *b = tLog;
+    if (!b) {
+        b = (LogBuf*)calloc(1, sizeof(LogBuf));
+        if (!b) die_errno("calloc(log)");
+        b->src = tSrc;
+        tLog = b;
+        LogBuf *head = atomic_load(&gLogBufs);
+        do {
+            b->next = head;
+        } while (!atomic_compare_exchange_weak(&gLogBufs, &head, b));
+    }
+    log_capture(b, ++tClock, fmt, ap);
+}
+
+// строка не влезла в cap байт: её хвост (по границе символа UTF-8) заменяется
+// меткой обрезки; возвращает длину
+static size_t log_truncated(char *line, size_t cap) {
+    size_t at = cap - sizeof(LOG_TRUNC_MARK);
+    while (at > 0 && ((unsigned char)line[at] & 0xC0) == 0x80) --at;
+    memcpy(line + at, LOG_TRUNC_MARK, sizeof(LOG_TRUNC_MARK));
+    return at + sizeof(LOG_TRUNC_MARK) - 1;
+}
+
+// форматирование строки из буфера (в стоке); возвращает длину
+static size_t log_render(const LogBuf *b, const LogEntry *e, char *out, size_t cap) {
+    size_t n = 0;
+    int cut = 0;
+    const LogArg *a = b->args ? &b->args[e->arg] : NULL;
+    for (const char *p = e->fmt; *p;) {
+        if (n + 1 >= cap) {
+            cut = 1;
+            break;
+        }
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        char conv, spec[16];
+        int lng;
+        const char *end = log_spec(p + 1, &conv, &lng);
+        size_t sl = (size_t)(end - p) < sizeof(spec) ? (size_t)(end - p) : sizeof(spec) - 1;
+        memcpy(spec, p, sl);
+        spec[sl] = '\0';
+        p = end;
+
+        int w;
+        if (conv == '%') w = snprintf(out + n, cap - n, "%%");
+        else if (!conv) break;
+        else if (conv == 's') w = snprintf(out + n, cap - n, spec, b->text + (a++)->s);
+        else if (strchr("feg", conv)) w = snprintf(out + n, cap - n, spec, (a++)->f);
+        else if (lng >= 2) w = snprintf(out + n, cap - n, spec, (a++)->i);
+        else if (lng == 1) w = snprintf(out + n, cap - n, spec, (long)(a++)->i);
+        else w = snprintf(out + n, cap - n, spec, (int)(a++)->i);
+        if (w > 0 && (size_t)w >= cap - n) {
+            cut = 1;
+            break;
+        }
+        if (w > 0) n += (size_t)w;
+    }
+    if (cut) return log_truncated(out, cap);
+    out[n] = '\0';
+    return n;
+}
+
+/*
+ * Сток лога (без --ordered-log): поток протокола под gPrintLock только копирует
+ * формат и аргументы в общий буфер, а форматирует и пишет отдельный поток-сток.
+ * Буферов два: пока сток печатает один, потоки дописывают другой. Порядок строк —
+ * порядок взятия мьютекса, как при печати прямо из потоков.
+ * Сток забирает буфер, когда в нём LOG_SINK_BATCH строк или когда с первой строки
+ * прошло LOG_SINK_DELAY_MS (а также по запросу log_sink_drain и при остановке).
+ */
+#define LOG_SINK_BATCH 256
+#define LOG_SINK_DELAY_MS 2
+
+static LogBuf gSinkBuf;                      // строки, ещё не взятые стоком (под gPrintLock)
+static pthread_cond_t gSinkCv;               // строки, полная пачка, сброс или стоп (CLOCK_MONOTONIC)
+static pthread_cond_t gSinkIdleCv = PTHREAD_COND_INITIALIZER;   // сток допечатал пачку
+static int gSinkOn = 0;                      // сток принимает строки (под gPrintLock)
+static int gSinkBusy = 0;                    // сток печатает пачку (под gPrintLock)
+static int gSinkFlush = 0;                   // log_sink_drain ждёт: пачку не копить
+static int gSinkStop = 0;
+static pthread_t gSinkThread;
+
+static void *log_sink_thread(void *arg) {
+    (void)arg;
+    LogBuf batch = { 0 };
+    char line[LOG_LINE_MAX];
+    int rc = pthread_mutex_lock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_lock(print)");
+    for (;;) {
+        while (!gSinkBuf.count && !gSinkStop) {
+            rc = pthread_cond_wait(&gSinkCv, &gPrintLock);
+            die_pthread(rc, "pthread_cond_wait(log sink)");
+        }
+        if (!gSinkBuf.count) break;
+
+        // копим пачку: до LOG_SINK_BATCH строк, но не дольше LOG_SINK_DELAY_MS
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_nsec += LOG_SINK_DELAY_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (gSinkBuf.count < LOG_SINK_BATCH && !gSinkFlush && !gSinkStop) {
+            rc = pthread_cond_timedwait(&gSinkCv, &gPrintLock, &until);
+            if (rc == ETIMEDOUT) break;
+            die_pthread(rc, "pthread_cond_timedwait(log sink)");
+        }
+
+        // забираем накопленное, потокам — пустой буфер прошлой пачки
+        LogBuf t = gSinkBuf;
+        gSinkBuf = batch;
+        batch = t;
+        gSinkBusy = 1;
+        rc = pthread_mutex_unlock(&gPrintLock);
+        die_pthread(rc, "pthread_mutex_unlock(print)");
+
+        for (size_t k = 0; k < batch.count; ++k) {
+            size_t len = log_render(&batch, &batch.ent[k], line, sizeof(line));
+            fwrite(line, 1, len, stdout);
+            if (gLogFile) fwrite(line, 1, len, gLogFile);
+        }
+        fflush(stdout);
+        if (gLogFile) fflush(gLogFile);
+        batch.count = batch.args_len = batch.text_len = 0;
+
+        rc = pthread_mutex_lock(&gPrintLock);
+        die_pthread(rc, "pthread_mutex_lock(print)");
+        gSinkBusy = 0;
+        pthread_cond_broadcast(&gSinkIdleCv);
+    }
+    rc = pthread_mutex_unlock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_unlock(print)");
+    free(batch.text);
+    free(batch.args);
+    free(batch.ent);
+    return NULL;
+}
+
+// остановка стока при взятом gPrintLock (отпускает его): сток допечатывает буфер и выходит
+static void log_sink_stop_locked(void) {
+    int on = gSinkOn;
+    gSinkOn = 0;
+    gSinkStop = 1;
+    pthread_cond_broadcast(&gSinkCv);
+    int rc = pthread_mutex_unlock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_unlock(print)");
+    if (!on || pthread_equal(pthread_self(), gSinkThread)) return;
+
+    rc = pthread_join(gSinkThread, NULL);
+    die_pthread(rc, "pthread_join(log sink)");
+    free(gSinkBuf.text);
+    free(gSinkBuf.args);
+    free(gSinkBuf.ent);
+    memset(&gSinkBuf, 0, sizeof(gSinkBuf));
+}
+
+static void log_sink_stop(void) {
+    int rc = pthread_mutex_lock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_lock(print)");
+    log_sink_stop_locked();
+}
+
+// при exit(): он мог прийти из-под gPrintLock (die_* в safe_print или в стоке),
+// а мьютекс не рекурсивный — занят он, значит сток не ждём и буфер теряем
+static void log_sink_atexit(void) {
+    if (pthread_mutex_trylock(&gPrintLock) != 0) return;
+    log_sink_stop_locked();
+}
+
+static void log_sink_start(const pthread_attr_t *attr) {
+    pthread_condattr_t cattr;
+    int rc = pthread_condattr_init(&cattr);
+    die_pthread(rc, "pthread_condattr_init");
+    rc = pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    die_pthread(rc, "pthread_condattr_setclock");
+    rc = pthread_cond_init(&gSinkCv, &cattr);
+    die_pthread(rc, "pthread_cond_init(log sink)");
+    pthread_condattr_destroy(&cattr);
+
+    rc = pthread_create(&gSinkThread, attr, log_sink_thread, NULL);
+    die_pthread(rc, "pthread_create(log sink)");
+    gSinkOn = 1;
+    if (atexit(log_sink_atexit) != 0) die_errno("atexit(log sink)");
+}
+
+// дождаться, пока сток напечатает уже принятые строки
+static void log_sink_drain(void) {
+    int rc = pthread_mutex_lock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_lock(print)");
+    gSinkFlush = 1;
+    pthread_cond_broadcast(&gSinkCv);
+    while (gSinkOn && (gSinkBuf.count || gSinkBusy)) {
+        rc = pthread_cond_wait(&gSinkIdleCv, &gPrintLock);
+        die_pthread(rc, "pthread_cond_wait(log sink)");
+    }
+    gSinkFlush = 0;
+    rc = pthread_mutex_unlock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_unlock(print)");
+}
+
+// сток лога: уровень уже проверен в LOG()
 static void safe_print(const char *fmt, ...) {
     va_list ap;
 
+    if (gOrderedLog) {
+        va_start(ap, fmt);
+        log_append(fmt, ap);
+        va_end(ap);
+        stat_inc(&gStats.log_lines);
+        return;
+    }
+
     // лочим, чтобы вывод разных потоков не смешивался
     int rc = pthread_mutex_lock(&gPrintLock);
     die_pthread(rc, "pthread_mutex_lock(print)");
+    if (gSinkOn) {
+        // без форматирования: сырые аргументы — стоку
+        va_start(ap, fmt);
+        log_capture(&gSinkBuf, 0, fmt, ap);
+        va_end(ap);
+        if (gSinkBuf.count == 1 || gSinkBuf.count == LOG_SINK_BATCH) pthread_cond_signal(&gSinkCv);
+        rc = pthread_mutex_unlock(&gPrintLock);
+        die_pthread(rc, "pthread_mutex_unlock(print)");
+        stat_inc(&gStats.log_lines);
+        return;
+    }
+    rc = pthread_mutex_unlock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_unlock(print)");
 
-    // печать в консоль
+    // стока нет (до запуска потоков и после exit()): форматируем здесь и вне мьютекса
+    char line[LOG_LINE_MAX];
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
     va_end(ap);
-    fflush(stdout);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = (int)log_truncated(line, sizeof(line));
+
+    rc = pthread_mutex_lock(&gPrintLock);
+    die_pthread(rc, "pthread_mutex_lock(print)");
 
-    // печать в файл (если задан ключ -o)
+    // печать в консоль и в файл (если задан ключ -o)
+    fwrite(line, 1, (size_t)len, stdout);
+    fflush(stdout);
     if (gLogFile) {
-        va_start(ap, fmt);
-        vfprintf(gLogFile, fmt, ap);
-        va_end(ap);
+        fwrite(line, 1, (size_t)len, gLogFile);
         fflush(gLogFile);
     }
 
     rc = pthread_mutex_unlock(&gPrintLock);
     die_pthread(rc, "pthread_mutex_unlock(print)");
+    stat_inc(&gStats.log_lines);
 }
 
-
-// генерация в диапазоне [lo..hi], используем rand_r (thread-safe по seed)
-static int rand_between(unsigned *seed, int lo, int hi) { // включительно
-    if (hi < lo) { int t = lo; lo = hi; hi = t; }
-    int span = hi - lo + 1;
-    return lo + (int)(rand_r(seed) % (unsigned)span);
+// main после join: часы всех потоков уже в их буферах — сдвигаем свои за максимум
+static void log_join_all(void) {
+    for (LogBuf *b = atomic_load(&gLogBufs); b; b = b->next) {
+        if (b->count) log_recv(b->ent[b->count - 1].ts);
+    }
 }
 
+// раньше ли строка буфера a[ia], чем b[ib]: по логическому времени, затем по источнику
+static int log_before(const LogBuf *a, size_t ia, const LogBuf *b, size_t ib) {
+    if (a->ent[ia].ts != b->ent[ib].ts) return a->ent[ia].ts < b->ent[ib].ts;
+    return a->src < b->src;
+}
 
-// обработчик Ctrl+C
-static void on_sigint(int signo) {
-    (void)signo;
-    atomic_store(&gStop, 1);
+// просеивание вниз в куче голов буферов (pos[i] — текущая строка буфера heap[i])
+static void log_sift_down(LogBuf **heap, size_t *pos, size_t n, size_t j) {
+    for (;;) {
+        size_t l = 2 * j + 1, m = j;
+        if (l < n && log_before(heap[l], pos[l], heap[m], pos[m])) m = l;
+        if (l + 1 < n && log_before(heap[l + 1], pos[l + 1], heap[m], pos[m])) m = l + 1;
+        if (m == j) return;
+        LogBuf *tb = heap[j]; heap[j] = heap[m]; heap[m] = tb;
+        size_t tp = pos[j]; pos[j] = pos[m]; pos[m] = tp;
+        j = m;
+    }
 }
 
-typedef struct {
-    int fan_id;        // номер поклонника (индекс в массивах)
-    unsigned base_seed;// базовый seed, чтобы сценарий был воспроизводим при заданном SEED
-} FanArgs;
+// k-путевое слияние буферов (в каждом строки уже упорядочены по времени):
+// двоичная куча из голов буферов, вывод в консоль и в лог-файл
+static void log_flush_merged(void) {
+    size_t k = 0;
+    for (LogBuf *b = atomic_load(&gLogBufs); b; b = b->next) ++k;
 
-static void *fan_thread(void *arg) {
-    FanArgs *a = (FanArgs*)arg;
-    int id = a->fan_id;
+    LogBuf **heap = (LogBuf**)calloc(k ? k : 1, sizeof(LogBuf*));
+    size_t *pos = (size_t*)calloc(k ? k : 1, sizeof(size_t));
+    if (!heap || !pos) die_errno("calloc(log merge)");
+
+    size_t n = 0;
+    for (LogBuf *b = atomic_load(&gLogBufs); b; b = b->next) {
+        if (b->count) heap[n++] = b;
+    }
+    for (size_t i = n; i-- > 0;) log_sift_down(heap, pos, n, i);
 
-    // локальный seed для rand_r: общий base_seed
-    unsigned seed = a->base_seed ^ (unsigned)(id * 2654435761u);
+    while (n > 0) {
+        const LogBuf *b = heap[0];
+        char line[LOG_LINE_MAX];
+        size_t len = log_render(b, &b->ent[pos[0]], line, sizeof(line));
+        fwrite(line, 1, len, stdout);
+        if (gLogFile) fwrite(line, 1, len, gLogFile);
 
-    // "думает" над предложением (имитация параллельного поведения)
-    int think = rand_between(&seed, 1, 3);
-    for (int s = 0; s < think; ++s) {
-        // если нажали Ctrl+C — корректно выходим
-        if (atomic_load(&gStop)) {
-            safe_print("[Клиент %02d] Прервано (SIGINT) во время обдумывания.\n", id);
-            return NULL;
+        if (++pos[0] == b->count) {
+            // буфер исчерпан: на его место — последний элемент кучи
+            --n;
+            heap[0] = heap[n];
+            pos[0] = pos[n];
         }
-        sleep(1u);
+        log_sift_down(heap, pos, n, 0);
     }
 
-    // формируем предложение
-    Offer offer;
-    offer.fan_id = id;
-    offer.score = rand_between(&seed, 1, 100);
-
-    // идеи вечера — фиксированный набор, выбираем случайно
-    const char *ideas[] = {
-        "прогулка по городу + кофе",
-        "кино + пицца",
-        "ужин при свечах",
-        "каток + горячий шоколад",
-        "настолки + чай",
-        "пикник (если погода позволит)",
-        "музей + прогулка",
-        "концерт + поздний ужин"
-    };
-    const int k = rand_between(&seed, 0, (int)(sizeof(ideas)/sizeof(ideas[0]) - 1));
-    snprintf(offer.text, sizeof(offer.text), "%s", ideas[k]);
+    fflush(stdout);
+    if (gLogFile) fflush(gLogFile);
+    free(heap);
+    free(pos);
 
-    // отправка запроса "на сервер":
-    // кладём предложение в свой слот и отмечаем флаг отправки
-    gOffers[id] = offer;
-    atomic_store(&gSubmitted[id], 1);
+    LogBuf *b = atomic_exchange(&gLogBufs, NULL);
+    while (b) {
+        LogBuf *next = b->next;
+        free(b->text);
+        free(b->args);
+        free(b->ent);
+        free(b);
+        b = next;
+    }
+    tLog = NULL;   // буфер main освобождён вместе с остальными (следующий раунд)
+}
+
+// строки, накопленные к этому моменту, — в вывод (конец раунда, итоги main)
+static void log_flush(void) {
+    if (gOrderedLog) log_flush_merged();
+    else log_sink_drain();
+}
 
-    safe_print("[Клиент %02d] Отправил валентинку: score=%d, идея='%s' (думал %dс)\n",
-               id, offer.score, offer.text, think);
+// снимок счётчиков: текст Prometheus (prom = 1) или одна строка для stderr
+static void write_stats(FILE *f, int prom) {
+    static const struct { const char *name, *help; size_t off; } kCounters[] = {
+        { "submitted",   "Offers submitted by fans",              offsetof(Stats, submitted) },
+        { "replied",     "Replies received by fans",              offsetof(Stats, replied) },
+        { "spins",       "Failed checks in busy-wait loops",      offsetof(Stats, spins) },
+        { "yields",      "sched_yield calls",                     offsetof(Stats, yields) },
+        { "cond_waits",  "Condition variable waits",              offsetof(Stats, cond_waits) },
+        { "timed_waits", "Timed poll waits (thinking, choosing)", offsetof(Stats, timed_waits) },
+        { "futex_waits", "Futex sleeps waiting for a reply",      offsetof(Stats, futex_waits) },
+        { "log_lines",   "Log lines emitted",                     offsetof(Stats, log_lines) },
+        { "snapshots",   "Snapshots requested with SIGUSR1",      offsetof(Stats, snapshots) },
+        { "rounds",      "Rounds played",                         offsetof(Stats, rounds) },
+        { "reloads",     "Config reloads accepted",               offsetof(Stats, reloads) },
+    };
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double uptime = (double)(now.tv_sec - gBenchStart.tv_sec) +
+                    (double)(now.tv_nsec - gBenchStart.tv_nsec) / 1e9;
 
-    // активное ожидание ответа:
-    // по условию поклонник получает ответ только после того, как все отправили предложения
-    while (!atomic_load(&gReplied[id])) {
-        if (atomic_load(&gStop)) {
-            safe_print("[Клиент %02d] Прервано (SIGINT) во время ожидания ответа.\n", id);
-            return NULL;
+    int n = atomic_load_explicit(&gStatsN, memory_order_relaxed);
+    if (!prom) fprintf(f, "[STATS] uptime=%.3fs N=%d", uptime, n);
+    for (size_t k = 0; k < sizeof(kCounters) / sizeof(kCounters[0]); ++k) {
+        unsigned long long v = atomic_load_explicit(
+            (atomic_ullong*)((char*)&gStats + kCounters[k].off), memory_order_relaxed);
+        if (prom) {
+            fprintf(f, "# HELP valentine_%s_total %s.\n# TYPE valentine_%s_total counter\n"
+                       "valentine_%s_total %llu\n",
+                    kCounters[k].name, kCounters[k].help, kCounters[k].name, kCounters[k].name, v);
+        } else {
+            fprintf(f, " %s=%llu", kCounters[k].name, v);
         }
-        // отдаём квант процессора, чтобы не "жечь" CPU полностью
-        sched_yield();
     }
+    if (prom) {
+        fprintf(f, "# HELP valentine_fans Number of fan threads.\n# TYPE valentine_fans gauge\n"
+                   "valentine_fans %d\n", n);
+        fprintf(f, "# HELP valentine_uptime_seconds Time since threads were started.\n"
+                   "# TYPE valentine_uptime_seconds gauge\nvalentine_uptime_seconds %.3f\n", uptime);
+    } else {
+        fprintf(f, "\n");
+    }
+}
 
-    // получаем ответ (студентка заполнила gReplies[id])
-    Reply rep = gReplies[id];
+// снимок в файл метрик (через временный файл и rename — читатель не увидит половину)
+// или, если файл не задан, в stderr
+static void dump_stats(void) {
+    if (!gMetricsPath) {
+        write_stats(stderr, 0);
+        return;
+    }
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", gMetricsPath);
+    FILE *f = fopen(tmp, "w");
+    if (!f) die_errno("fopen(metrics)");
+    write_stats(f, 1);
+    if (fclose(f) != 0) die_errno("fclose(metrics)");
+    if (rename(tmp, gMetricsPath) != 0) die_errno("rename(metrics)");
+}
 
-    // предметная реакция клиента
-    if (rep.accepted) {
-        safe_print("[Клиент %02d] Ответ: Принято! (best_score=%d)\n", id, rep.best_score);
-    } else {
-        // если winner_id < 0 — значит завершение по SIGINT
-        if (rep.winner_id < 0) {
-            safe_print("[Клиент %02d] Ответ: Отказ. (работа остановлена пользователем)\n", id);
-        } else {
-            safe_print("[Клиент %02d] Ответ: Отказ. Победил %02d (best_score=%d). Реакция: '%s'\n",
-                       id, rep.winner_id, rep.best_score,
-                       (offer.score + 10 < rep.best_score) ? "надо было стараться(" : "обидно, почти выиграл!");
+/*
+ * Аппаратные счётчики по фазам протокола (--perf). Каждый поток сервера и каждый
+ * поклонник открывают счётчики perf_event_open только на себя (pid = 0, cpu = -1).
+ * На границе фазы поток читает счётчики и относит прирост к завершившейся фазе.
+ * При выходе потока суммы добавляются в общую таблицу gPerfCells[роль][фаза].
+ * Событие, которое не открылось при пробе в main (нет PMU в виртуалке,
+ * perf_event_paranoid), пропускается, и в отчёте вместо него стоит n/a.
+ */
+enum { PERF_FAN = 0, PERF_SERVER, PERF_ROLES };
+enum { PH_THINK = 0, PH_SUBMIT, PH_COLLECT, PH_SELECT, PH_REPLY, PERF_PHASES };
+enum { EV_CYCLES = 0, EV_INSTR, EV_L1D_MISS, EV_LLC_MISS, EV_CTX_SW, EV_TASK_CLOCK, PERF_EVENTS };
+
+static const struct { uint32_t type; uint64_t config; const char *name; } kPerfEvents[PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "l1d_misses" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "llc_misses" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "ctx_switches" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock_ns" },
+};
+
+typedef struct {
+    _Alignas(64) atomic_ullong calls;
+    atomic_ullong v[PERF_EVENTS];
+} PerfCell;
+
+typedef struct {
+    int fd[PERF_EVENTS];
+    uint64_t last[PERF_EVENTS];
+    int phase;                                  // -1 = вне фаз
+    uint64_t acc[PERF_PHASES][PERF_EVENTS];
+    unsigned calls[PERF_PHASES];
+} PerfThread;
+
+static int gPerf = 0;                           // --perf
+static int gPerfAvail[PERF_EVENTS];             // событие открылось при пробе
+static int gPerfUserOnly[PERF_EVENTS];          // открылось только с exclude_kernel
+static PerfCell gPerfCells[PERF_ROLES][PERF_PHASES];
+static atomic_int gPerfNoFd = 0;                // потоки, которым не хватило дескрипторов
+static _Thread_local PerfThread tPerf;
+static _Thread_local int tPerfRole = -1;        // -1 = поток не профилируется
+
+static int perf_open(int e, int user_only) {
+    struct perf_event_attr a;
+    memset(&a, 0, sizeof(a));
+    a.size = sizeof(a);
+    a.type = kPerfEvents[e].type;
+    a.config = kPerfEvents[e].config;
+    a.exclude_kernel = (unsigned)user_only;
+    a.exclude_hv = 1;
+    a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &a, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// значение счётчика с поправкой на мультиплексирование (счётчик стоял не всё время)
+static uint64_t perf_read(int fd) {
+    struct { uint64_t value, enabled, running; } r;
+    if (fd < 0 || read(fd, &r, sizeof(r)) != (ssize_t)sizeof(r) || r.running == 0) return 0;
+    if (r.running < r.enabled) return (uint64_t)((double)r.value * (double)r.enabled / (double)r.running);
+    return r.value;
+}
+
+// проба в main: какие события доступны; недоступные перечисляются один раз
+static void perf_probe(void) {
+    char missing[512] = "";
+    int avail = 0;
+    for (int e = 0; e < PERF_EVENTS; ++e) {
+        int fd = perf_open(e, 0);
+        if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+            // при perf_event_paranoid >= 2 разрешены только события пользовательского режима
+            fd = perf_open(e, 1);
+            gPerfUserOnly[e] = 1;
+        }
+        if (fd < 0) {
+            size_t len = strlen(missing);
+            snprintf(missing + len, sizeof(missing) - len, "%s%s (%s)",
+                     len ? ", " : "", kPerfEvents[e].name, strerror(errno));
+            continue;
         }
+        gPerfAvail[e] = 1;
+        ++avail;
+        close(fd);
+    }
+    if (missing[0]) {
+        fprintf(stderr, "[PERF] unavailable: %s%s\n", missing,
+                avail ? "" : "; phases are reported without counters");
     }
 
-    return NULL;
+    // по PERF_EVENTS дескрипторов на поток: поднимаем мягкий лимит до жёсткого
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 }
 
-// если работа прервана, всем выдаём отказ и помечаем, что ответ готов
-static void send_abort_replies(void) {
-    for (int i = 0; i < gN; ++i) {
-        gReplies[i].accepted = 0;
-        gReplies[i].winner_id = -1;
-        gReplies[i].best_score = -1;
-        atomic_store(&gReplied[i], 1);
+static void perf_thread_begin(int role) {
+    if (!gPerf) return;
+    tPerfRole = role;
+    memset(&tPerf, 0, sizeof(tPerf));
+    tPerf.phase = -1;
+    int no_fd = 0;
+    for (int e = 0; e < PERF_EVENTS; ++e) {
+        tPerf.fd[e] = gPerfAvail[e] ? perf_open(e, gPerfUserOnly[e]) : -1;
+        if (tPerf.fd[e] < 0 && gPerfAvail[e] && errno == EMFILE) no_fd = 1;
+        tPerf.last[e] = perf_read(tPerf.fd[e]);
     }
+    if (no_fd) atomic_fetch_add_explicit(&gPerfNoFd, 1, memory_order_relaxed);
 }
 
+// граница фазы: прирост с прошлой границы — текущей фазе, дальше считаем фазу ph
+static void perf_phase(int ph) {
+    if (tPerfRole < 0) return;
+    for (int e = 0; e < PERF_EVENTS; ++e) {
+        uint64_t v = perf_read(tPerf.fd[e]);
+        if (tPerf.phase >= 0) tPerf.acc[tPerf.phase][e] += v - tPerf.last[e];
+        tPerf.last[e] = v;
+    }
+    if (ph >= 0) tPerf.calls[ph]++;
+    tPerf.phase = ph;
+}
 
-static void *girl_thread(void *arg) {
-    (void)arg;
+// выход потока: закрыть последнюю фазу и слить суммы в общую таблицу
+static void perf_thread_end(void) {
+    if (tPerfRole < 0) return;
+    perf_phase(-1);
+    for (int ph = 0; ph < PERF_PHASES; ++ph) {
+        if (!tPerf.calls[ph]) continue;
+        PerfCell *c = &gPerfCells[tPerfRole][ph];
+        atomic_fetch_add_explicit(&c->calls, tPerf.calls[ph], memory_order_relaxed);
+        for (int e = 0; e < PERF_EVENTS; ++e)
+            atomic_fetch_add_explicit(&c->v[e], tPerf.acc[ph][e], memory_order_relaxed);
+    }
+    for (int e = 0; e < PERF_EVENTS; ++e) {
+        if (tPerf.fd[e] >= 0) close(tPerf.fd[e]);
+    }
+    tPerfRole = -1;
+}
 
-    safe_print("[Сервер] Студентка: жду все валентинки...\n");
+// отчёт при выходе: суммы по (роль, фаза), все потоки уже завершены
+static void perf_report(void) {
+    static const char *roles[PERF_ROLES] = { "fan", "server" };
+    static const char *phases[PERF_PHASES] = { "think", "submit", "collect", "select", "reply" };
 
-    // ждём, пока все N клиентов выставят submitted[i] (активно)
-    for (;;) {
-        // если прервали по Ctrl+C — сразу рассылаем отказ и выходим
-        if (atomic_load(&gStop)) {
-            safe_print("[Сервер] Получен SIGINT. Рассылаю всем отказ и завершаю.\n");
-            send_abort_replies();
-            return NULL;
+    fprintf(stderr, "[PERF] %-15s %7s", "phase", "calls");
+    for (int e = 0; e < PERF_EVENTS; ++e) fprintf(stderr, " %14s", kPerfEvents[e].name);
+    fprintf(stderr, " %6s\n", "ipc");
+    for (int r = 0; r < PERF_ROLES; ++r) {
+        for (int ph = 0; ph < PERF_PHASES; ++ph) {
+            const PerfCell *c = &gPerfCells[r][ph];
+            unsigned long long calls = atomic_load_explicit(&c->calls, memory_order_relaxed);
+            if (!calls) continue;
+
+            char name[32];
+            snprintf(name, sizeof(name), "%s.%s", roles[r], phases[ph]);
+            fprintf(stderr, "[PERF] %-15s %7llu", name, calls);
+            unsigned long long v[PERF_EVENTS];
+            for (int e = 0; e < PERF_EVENTS; ++e) {
+                v[e] = atomic_load_explicit(&c->v[e], memory_order_relaxed);
+                if (gPerfAvail[e]) fprintf(stderr, " %14llu", v[e]);
+                else fprintf(stderr, " %14s", "n/a");
+            }
+            if (gPerfAvail[EV_CYCLES] && gPerfAvail[EV_INSTR] && v[EV_CYCLES])
+                fprintf(stderr, " %6.2f\n", (double)v[EV_INSTR] / (double)v[EV_CYCLES]);
+            else
+                fprintf(stderr, " %6s\n", "n/a");
         }
+    }
+    int no_fd = atomic_load(&gPerfNoFd);
+    if (no_fd) fprintf(stderr, "[PERF] %d threads ran without some counters (out of file descriptors)\n", no_fd);
+}
 
-        int ready = 1;
-        for (int i = 0; i < gN; ++i) {
-            if (!atomic_load(&gSubmitted[i])) { ready = 0; break; }
+
+// генерация в диапазоне [lo..hi], используем rand_r (thread-safe по seed)
+static int rand_between(unsigned *seed, int lo, int hi) { // включительно
+    if (hi < lo) { int t = lo; lo = hi; hi = t; }
+    int span = hi - lo + 1;
+    return lo + (int)(rand_r(seed) % (unsigned)span);
+}
+
+// идеи вечера — фиксированный набор, выбираем случайно
+static const char *const kIdeas[] = {
+    "прогулка по городу + кофе",
+    "кино + пицца",
+    "ужин при свечах",
+    "каток + горячий шоколад",
+    "настолки + чай",
+    "пикник (если погода позволит)",
+    "музей + прогулка",
+    "концерт + поздний ужин"
+};
+#define IDEAS_COUNT ((int)(sizeof(kIdeas) / sizeof(kIdeas[0])))
+
+/*
+ * Генераторы случайных чисел (--rng):
+ *  rand_r  — совместимый режим: seed поклонника = SEED ^ id*2654435761, диапазон по модулю
+ *            (воспроизводит out1.txt/out2.txt и т.д.);
+ *  xoshiro — xoshiro256**, у поклонника i состояние сдвинуто на i прыжков по 2^128 шагов;
+ *  pcg     — PCG32 (XSH-RR), у поклонника i свой поток (inc = 2*i+1).
+ * Для xoshiro/pcg диапазоны без смещения (метод Лемира с отбраковкой).
+ */
+enum { RNG_RAND_R = 0, RNG_XOSHIRO, RNG_PCG };
+
+static int gRng = RNG_RAND_R;
+
+typedef struct { uint64_t s[4]; } Xoshiro256;
+typedef struct { uint64_t state, inc; } Pcg32;
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t xoshiro_next(Xoshiro256 *x) {
+    uint64_t *s = x->s;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+// прыжок на 2^128 шагов: непересекающиеся подпоследовательности для разных поклонников
+static void xoshiro_jump(Xoshiro256 *x) {
+    static const uint64_t JUMP[] = {
+        0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull,
+        0xA9582618E03FC9AAull, 0x39ABDC4529B1661Cull
+    };
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (int i = 0; i < 4; ++i) {
+        for (int b = 0; b < 64; ++b) {
+            if (JUMP[i] & (1ull << b)) {
+                s0 ^= x->s[0];
+                s1 ^= x->s[1];
+                s2 ^= x->s[2];
+                s3 ^= x->s[3];
+            }
+            xoshiro_next(x);
         }
-        if (ready) break;
+    }
+    x->s[0] = s0;
+    x->s[1] = s1;
+    x->s[2] = s2;
+    x->s[3] = s3;
+}
+
+static void xoshiro_seed(Xoshiro256 *x, uint64_t seed) {
+    for (int i = 0; i < 4; ++i) x->s[i] = splitmix64(&seed);
+}
+
+static uint32_t pcg32_next(Pcg32 *p) {
+    uint64_t old = p->state;
+    p->state = old * 6364136223846793005ull + p->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+static void pcg32_seed(Pcg32 *p, uint64_t seed, uint64_t stream) {
+    p->state = 0;
+    p->inc = (stream << 1) | 1u;
+    pcg32_next(p);
+    p->state += seed;
+    pcg32_next(p);
+}
+
+// [lo..hi] без смещения: x — 32 случайных бита, range = hi - lo + 1;
+// возвращает 0, если значение нужно отбраковать и взять новое x
+static int lemire_accept(uint32_t x, uint32_t range, int lo, int *out) {
+    uint64_t m = (uint64_t)x * range;
+    uint32_t l = (uint32_t)m;
+    if (l < range && l < (uint32_t)(-range) % range) return 0;
+    *out = lo + (int)(m >> 32);
+    return 1;
+}
+
+static int xoshiro_between(Xoshiro256 *x, int lo, int hi) {
+    int v;
+    while (!lemire_accept((uint32_t)(xoshiro_next(x) >> 32), (uint32_t)(hi - lo + 1), lo, &v)) {
+    }
+    return v;
+}
+
+static int pcg_between(Pcg32 *p, int lo, int hi) {
+    int v;
+    while (!lemire_accept(pcg32_next(p), (uint32_t)(hi - lo + 1), lo, &v)) {
+    }
+    return v;
+}
+
+// аргументы потока-поклонника
+typedef struct {
+    int fan_id;        // номер поклонника (индекс в массивах)
+} FanArgs;
+
+// заранее сгенерированные параметры поклонников (структура массивов)
+typedef struct {
+    unsigned char *think;   // время обдумывания, gThinkMin..gThinkMax с
+    int *score;             // привлекательность, 1..100
+    unsigned char *idea;    // индекс в kIdeas
+    unsigned char *cost;    // стоимость, 1..100
+    unsigned char *duration; // длительность, 1..6 ч
+} FanParams;
+
+static FanParams gParams;
+
+#define THINK_LIMIT 60                // верхняя граница THINK_MAX, с
+
+static int gThinkMin = 1;             // диапазон обдумывания (THINK_MIN=/THINK_MAX= в конфиге)
+static int gThinkMax = 3;
+static int gThinkUnitMs = 1000;       // --think-unit MS: длина "секунды" обдумывания и выбора
+
+/*
+ * Арена состояния прогона: все массивы на N поклонников (предложения, ответы, флаги,
+ * параметры, pthread_t и аргументы потоков) лежат в одном отображении памяти.
+ * Сначала пробуем явные huge pages (MAP_HUGETLB), иначе обычные страницы с
+ * MAP_POPULATE и подсказкой MADV_HUGEPAGE. Каждый регион выровнен по ARENA_ALIGN
+ * (кэш-линия), арену можно сбросить между раундами без повторных выделений.
+ */
+#define ARENA_ALIGN 64
+#define HUGE_PAGE_SIZE (2u * 1024 * 1024)
+
+typedef struct {
+    unsigned char *base;
+    size_t size;       // размер отображения
+    size_t used;       // занято регионами
+    int huge;          // 1 — отображение на явных huge pages
+} Arena;
+
+static Arena gArena;
+
+static size_t align_up(size_t x, size_t a) {
+    return (x + a - 1) & ~(a - 1);
+}
+
+static void arena_init(Arena *a, size_t size) {
+    a->used = 0;
+    a->size = align_up(size, HUGE_PAGE_SIZE);
+    a->huge = 1;
+    void *p = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED) {
+        a->huge = 0;
+        a->size = align_up(size, (size_t)sysconf(_SC_PAGESIZE));
+        p = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (p == MAP_FAILED) die_errno("mmap(arena)");
+        madvise(p, a->size, MADV_HUGEPAGE);  // лишь подсказка, ошибку не проверяем
+    }
+    a->base = (unsigned char*)p;
+}
+
+// регион из арены: выровнен по ARENA_ALIGN, заполнен нулями (свежая память или reset)
+static void *arena_alloc(Arena *a, size_t size) {
+    size_t off = align_up(a->used, ARENA_ALIGN);
+    if (off + size > a->size) {
+        fprintf(stderr, "arena overflow: need %zu bytes, have %zu\n", off + size, a->size);
+        exit(1);
+    }
+    a->used = off + size;
+    return a->base + off;
+}
+
+// сброс между раундами: регионы выдаются заново с начала, память обнуляется
+static void arena_reset(Arena *a) {
+    memset(a->base, 0, a->used);
+    a->used = 0;
+}
+
+static void arena_free(Arena *a) {
+    if (a->base) munmap(a->base, a->size);
+    a->base = NULL;
+}
+
+/*
+ * Очередь предложений (--queue): ограниченная MPSC-очередь без блокировок —
+ * кольцо Вьюкова, в каждой ячейке номер последовательности. Поклонник после
+ * успешной отправки кладёт в неё свой id, а студентка разбирает её прямо во время
+ * обдумывания: текущая статистика, рейтинг по мере прибытия и лог в порядке прихода.
+ * Ёмкость — степень двойки не меньше N, так что за раунд очередь не переполняется;
+ * если бы переполнилась, поклонник ждал бы свободной ячейки.
+ * Порядок памяти у очереди свой (acquire/release на seq), от --order он не зависит.
+ */
+typedef struct {
+    atomic_uint seq;                    // == pos: ячейка свободна для pos; == pos + 1: занята
+    int fan_id;
+} QueueCell;
+
+typedef struct {
+    QueueCell *cells;
+    unsigned mask;                      // ёмкость - 1
+    _Alignas(64) atomic_uint tail;      // следующая позиция записи (поклонники)
+    _Alignas(64) unsigned head;         // следующая позиция чтения (только студентка)
+} OfferQueue;
+
+static int gQueueMode = 0;              // --queue
+static OfferQueue gQueue;
+
+static size_t queue_capacity(int n) {
+    size_t cap = 1;
+    while (cap < (size_t)n) cap <<= 1;
+    return cap;
+}
+
+static void queue_init(OfferQueue *q, QueueCell *cells, int n) {
+    size_t cap = queue_capacity(n);
+    q->cells = cells;
+    q->mask = (unsigned)(cap - 1);
+    for (size_t k = 0; k < cap; ++k) atomic_init(&cells[k].seq, (unsigned)k);
+    atomic_init(&q->tail, 0);
+    q->head = 0;
+}
+
+// 0 — очередь полна
+static int queue_push(OfferQueue *q, int id) {
+    unsigned pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+        QueueCell *c = &q->cells[pos & q->mask];
+        unsigned seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        int dif = (int)(seq - pos);
+        if (dif == 0) {
+            // ячейка свободна: занимаем позицию, при неудаче CAS pos уже обновлён
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                c->fan_id = id;
+                atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// 0 — очередная ячейка ещё не заполнена (очередь пуста или запись не завершена)
+static int queue_pop(OfferQueue *q, int *id) {
+    QueueCell *c = &q->cells[q->head & q->mask];
+    if (atomic_load_explicit(&c->seq, memory_order_acquire) != q->head + 1) return 0;
+    *id = c->fan_id;
+    atomic_store_explicit(&c->seq, q->head + q->mask + 1, memory_order_release);
+    q->head++;
+    return 1;
+}
+
+// массивы одного прогона на n поклонников (раскладка в арене)
+typedef struct {
+    Offer *offers;
+    Reply *replies;
+    atomic_int *submitted;
+    atomic_int *replied;
+    pthread_t *clients;
+    FanArgs *args;
+    unsigned char *think;
+    int *score;
+    unsigned char *idea;
+    unsigned char *cost;
+    unsigned char *duration;
+    int *cols;               // столбцы OfferCols: 5 подряд по n элементов
+    QueueCell *queue;        // ячейки очереди предложений (--queue)
+} RunState;
+
+// размер арены под n поклонников с учётом выравнивания каждого региона
+static size_t run_state_size(int n) {
+    size_t un = (size_t)n;
+    size_t sizes[] = {
+        un * sizeof(Offer), un * sizeof(Reply),
+        un * sizeof(atomic_int), un * sizeof(atomic_int),
+        un * sizeof(pthread_t), un * sizeof(FanArgs),
+        un, un * sizeof(int), un, un, un,
+        5 * un * sizeof(int),
+        gQueueMode ? queue_capacity(n) * sizeof(QueueCell) : 0
+    };
+    size_t total = 0;
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+        total += align_up(sizes[k], ARENA_ALIGN);
+    }
+    return total;
+}
+
+static void run_state_alloc(Arena *a, RunState *st, int n) {
+    size_t un = (size_t)n;
+    st->offers = (Offer*)arena_alloc(a, un * sizeof(Offer));
+    st->replies = (Reply*)arena_alloc(a, un * sizeof(Reply));
+    st->submitted = (atomic_int*)arena_alloc(a, un * sizeof(atomic_int));
+    st->replied = (atomic_int*)arena_alloc(a, un * sizeof(atomic_int));
+    st->clients = (pthread_t*)arena_alloc(a, un * sizeof(pthread_t));
+    st->args = (FanArgs*)arena_alloc(a, un * sizeof(FanArgs));
+    st->think = (unsigned char*)arena_alloc(a, un);
+    st->score = (int*)arena_alloc(a, un * sizeof(int));
+    st->idea = (unsigned char*)arena_alloc(a, un);
+    st->cost = (unsigned char*)arena_alloc(a, un);
+    st->duration = (unsigned char*)arena_alloc(a, un);
+    st->cols = (int*)arena_alloc(a, 5 * un * sizeof(int));
+    st->queue = gQueueMode ? (QueueCell*)arena_alloc(a, queue_capacity(n) * sizeof(QueueCell)) : NULL;
+}
+
+/*
+ * Кэш результатов (--cache FILE). Без дедлайна и досрочного решения итог раунда
+ * полностью задан движком, N, SEED, генератором и весами — от времени он не зависит.
+ * Файл — хеш-таблица с открытой адресацией на CACHE_SLOTS записей, отображённая
+ * в память (MAP_SHARED); запись в неё идёт под исключительным flock, поиск — под
+ * разделяемым, так что файл могут делить параллельные процессы. Перед раундом
+ * main ищет сценарий и при попадании печатает итог без запуска потоков; сыгранный
+ * раунд записывается. Формат записи общий с версией 9-10, движки различаются
+ * полем engine.
+ * --cache-verify K: каждый K-й найденный сценарий (по хешу ключа) всё равно
+ * играется и сверяется с записью; расхождение — "дрейф" движка, код выхода 3.
+ */
+#define CACHE_MAGIC 0x31435256u    // "VRC1"
+#define CACHE_SLOTS 4096
+#define CACHE_MAX_N 1000
+#define CACHE_ENGINE "8"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t entry_size;
+    uint32_t reserved[13];
+} CacheHeader;
+
+typedef struct {
+    atomic_uint used;                // 1 — запись заполнена (выставляется последним)
+    char engine[12];
+    uint64_t cfg;                    // хеш прочих параметров, влияющих на итог
+    int32_t n;
+    uint32_t seed;
+    int32_t winner_id;
+    int32_t best_score;
+    uint8_t accepted[CACHE_MAX_N];   // ответ каждому поклоннику: 1 — принят
+} CacheEntry;
+
+static const char *gCachePath = NULL;   // --cache FILE
+static int gCacheVerify = 0;            // --cache-verify K: 0 = не сверять
+static int gCacheFd = -1;
+static CacheHeader *gCache = NULL;      // отображение файла: заголовок, затем записи
+static int gCacheDrift = 0;             // найдено расхождений с кэшем
+
+static CacheEntry *cache_slot(uint32_t k) {
+    return (CacheEntry*)((unsigned char*)gCache + sizeof(CacheHeader)) + k;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t len) {
+    const unsigned char *b = (const unsigned char*)p;
+    for (size_t k = 0; k < len; ++k) h = (h ^ b[k]) * 1099511628211ull;
+    return h;
+}
+
+// параметры, от которых зависит итог: генератор, веса, диапазон обдумывания
+static uint64_t cache_cfg_hash(void) {
+    int v[] = { gRng, gWeights.score, gWeights.cost, gWeights.duration, gWeights.idea,
+                gWeights.fav_idea, gThinkMin, gThinkMax };
+    return fnv1a(14695981039346656037ull, v, sizeof(v));
+}
+
+static uint64_t cache_key_hash(uint64_t cfg, int n, unsigned seed) {
+    uint64_t h = fnv1a(14695981039346656037ull, CACHE_ENGINE, sizeof(CACHE_ENGINE));
+    h = fnv1a(h, &cfg, sizeof(cfg));
+    h = fnv1a(h, &n, sizeof(n));
+    return fnv1a(h, &seed, sizeof(seed));
+}
+
+static void cache_open(const char *path) {
+    size_t size = sizeof(CacheHeader) + (size_t)CACHE_SLOTS * sizeof(CacheEntry);
+    gCacheFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (gCacheFd < 0) die_errno("open(cache)");
+    if (flock(gCacheFd, LOCK_EX) != 0) die_errno("flock(cache)");
+    struct stat sb;
+    if (fstat(gCacheFd, &sb) != 0) die_errno("fstat(cache)");
+    int fresh = sb.st_size == 0;
+    if (fresh && ftruncate(gCacheFd, (off_t)size) != 0) die_errno("ftruncate(cache)");
+    if (!fresh && (size_t)sb.st_size != size) {
+        fprintf(stderr, "[CACHE] %s: size mismatch, cache disabled\n", path);
+        close(gCacheFd);
+        gCacheFd = -1;
+        return;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, gCacheFd, 0);
+    if (p == MAP_FAILED) die_errno("mmap(cache)");
+    gCache = (CacheHeader*)p;
+    if (fresh) {
+        gCache->magic = CACHE_MAGIC;
+        gCache->slots = CACHE_SLOTS;
+        gCache->entry_size = sizeof(CacheEntry);
+    } else if (gCache->magic != CACHE_MAGIC || gCache->slots != CACHE_SLOTS ||
+               gCache->entry_size != sizeof(CacheEntry)) {
+        fprintf(stderr, "[CACHE] %s: not a result cache of this format, cache disabled\n", path);
+        munmap(p, size);
+        gCache = NULL;
+    }
+    if (flock(gCacheFd, LOCK_UN) != 0) die_errno("flock(cache)");
+}
+
+static void cache_close(void) {
+    if (gCache) munmap(gCache, sizeof(CacheHeader) + (size_t)CACHE_SLOTS * sizeof(CacheEntry));
+    if (gCacheFd >= 0) close(gCacheFd);
+    gCache = NULL;
+    gCacheFd = -1;
+}
+
+// кэш применим к этому раунду: итог не зависит от времени
+static int cache_usable(void) {
+    return gCache && !gDeadlineMs && !gEarly && gN <= CACHE_MAX_N;
+}
+
+// поиск записи (копия в *out); 1 — найдена. Под разделяемым flock: cache_store
+// держит исключительный, поэтому копия не застанет запись наполовину, а проба —
+// временно сброшенный used
+static int cache_lookup(int n, unsigned seed, CacheEntry *out) {
+    if (flock(gCacheFd, LOCK_SH) != 0) die_errno("flock(cache)");
+    uint64_t cfg = cache_cfg_hash();
+    uint32_t k = (uint32_t)(cache_key_hash(cfg, n, seed) % CACHE_SLOTS);
+    int found = 0;
+    for (uint32_t probe = 0; probe < CACHE_SLOTS; ++probe, k = (k + 1) % CACHE_SLOTS) {
+        CacheEntry *e = cache_slot(k);
+        if (!atomic_load_explicit(&e->used, memory_order_acquire)) break;
+        if (e->n == n && e->seed == seed && e->cfg == cfg && !strcmp(e->engine, CACHE_ENGINE)) {
+            memcpy(out, e, sizeof(*out));
+            found = 1;
+            break;
+        }
+    }
+    if (flock(gCacheFd, LOCK_UN) != 0) die_errno("flock(cache)");
+    return found;
+}
+
+// запись результата: своя запись перезаписывается, иначе занимается первая свободная
+static void cache_store(const CacheEntry *r) {
+    if (flock(gCacheFd, LOCK_EX) != 0) die_errno("flock(cache)");
+    uint32_t k = (uint32_t)(cache_key_hash(r->cfg, r->n, r->seed) % CACHE_SLOTS);
+    uint32_t probe = 0;
+    for (; probe < CACHE_SLOTS; ++probe, k = (k + 1) % CACHE_SLOTS) {
+        CacheEntry *e = cache_slot(k);
+        if (!atomic_load_explicit(&e->used, memory_order_acquire)) break;
+        if (e->n == r->n && e->seed == r->seed && e->cfg == r->cfg && !strcmp(e->engine, r->engine)) break;
+    }
+    if (probe == CACHE_SLOTS) {
+        fprintf(stderr, "[CACHE] full (%d entries), result not stored\n", CACHE_SLOTS);
+    } else {
+        CacheEntry *e = cache_slot(k);
+        atomic_store_explicit(&e->used, 0, memory_order_relaxed);
+        memcpy(e->engine, r->engine, sizeof(e->engine));
+        e->cfg = r->cfg;
+        e->n = r->n;
+        e->seed = r->seed;
+        e->winner_id = r->winner_id;
+        e->best_score = r->best_score;
+        memcpy(e->accepted, r->accepted, sizeof(e->accepted));
+        atomic_store_explicit(&e->used, 1, memory_order_release);
+    }
+    if (flock(gCacheFd, LOCK_UN) != 0) die_errno("flock(cache)");
+}
+
+// найденный сценарий выбран для сверки (--cache-verify K)
+static int cache_pick_verify(const CacheEntry *e) {
+    return gCacheVerify && cache_key_hash(e->cfg, e->n, e->seed) % (uint64_t)gCacheVerify == 0;
+}
+
+// сверка сыгранного раунда с записью; 1 — совпало
+static int cache_verify(const CacheEntry *want, const CacheEntry *got) {
+    int diff = 0;
+    for (int i = 0; i < got->n; ++i) diff += want->accepted[i] != got->accepted[i];
+    if (!diff && want->winner_id == got->winner_id && want->best_score == got->best_score) {
+        fprintf(stderr, "[CACHE] verified: engine=%s N=%d SEED=%u\n", got->engine, got->n, got->seed);
+        return 1;
+    }
+    fprintf(stderr, "[CACHE] drift: engine=%s N=%d SEED=%u: cached winner=%d best_score=%d, "
+                    "got winner=%d best_score=%d, %d replies differ\n",
+            got->engine, got->n, got->seed, want->winner_id, want->best_score,
+            got->winner_id, got->best_score, diff);
+    ++gCacheDrift;
+    return 0;
+}
+
+/*
+ * Пакетная генерация параметров поклонников [first, first+count):
+ * порядок выборок у каждого поклонника фиксирован (think, score, idea, cost, duration),
+ * поэтому результат не зависит от того, сколькими пакетами идёт генерация.
+ */
+static void gen_fan_params(unsigned base_seed, int first, int count) {
+    if (gRng == RNG_RAND_R) {
+        for (int i = first; i < first + count; ++i) {
+            unsigned seed = base_seed ^ (unsigned)(i * 2654435761u);
+            gParams.think[i] = (unsigned char)rand_between(&seed, gThinkMin, gThinkMax);
+            gParams.score[i] = rand_between(&seed, SCORE_MIN, SCORE_MAX);
+            gParams.idea[i] = (unsigned char)rand_between(&seed, 0, IDEAS_COUNT - 1);
+            gParams.cost[i] = (unsigned char)rand_between(&seed, 1, 100);
+            gParams.duration[i] = (unsigned char)rand_between(&seed, 1, 6);
+        }
+    } else if (gRng == RNG_XOSHIRO) {
+        Xoshiro256 x;
+        xoshiro_seed(&x, base_seed);
+        for (int i = 0; i < first; ++i) xoshiro_jump(&x);
+        for (int i = first; i < first + count; ++i) {
+            Xoshiro256 fan = x;
+            gParams.think[i] = (unsigned char)xoshiro_between(&fan, gThinkMin, gThinkMax);
+            gParams.score[i] = xoshiro_between(&fan, SCORE_MIN, SCORE_MAX);
+            gParams.idea[i] = (unsigned char)xoshiro_between(&fan, 0, IDEAS_COUNT - 1);
+            gParams.cost[i] = (unsigned char)xoshiro_between(&fan, 1, 100);
+            gParams.duration[i] = (unsigned char)xoshiro_between(&fan, 1, 6);
+            xoshiro_jump(&x);
+        }
+    } else {
+        for (int i = first; i < first + count; ++i) {
+            Pcg32 p;
+            pcg32_seed(&p, base_seed, (uint64_t)i);
+            gParams.think[i] = (unsigned char)pcg_between(&p, gThinkMin, gThinkMax);
+            gParams.score[i] = pcg_between(&p, SCORE_MIN, SCORE_MAX);
+            gParams.idea[i] = (unsigned char)pcg_between(&p, 0, IDEAS_COUNT - 1);
+            gParams.cost[i] = (unsigned char)pcg_between(&p, 1, 100);
+            gParams.duration[i] = (unsigned char)pcg_between(&p, 1, 6);
+        }
+    }
+}
+
+// столбцы OfferCols на n ящиков из одного блока mem (5 * n int)
+static void cols_bind(OfferCols *c, int *mem, int n) {
+    c->score = mem;
+    c->cost = mem + n;
+    c->duration = mem + 2 * n;
+    c->idea = mem + 3 * n;
+    c->rating = mem + 4 * n;
+}
+
+// рейтинг одного предложения (поклонник в режиме дерева, хвост векторного прохода)
+static int rate_one(int score, int cost, int duration, int idea) {
+    const Weights *w = &gWeights;
+    return w->score * score + w->cost * cost + w->duration * duration +
+           (idea == w->fav_idea ? w->idea : 0);
+}
+
+/*
+ * Векторная оценка: 4 предложения за шаг (векторные расширения GCC, SSE2 на x86-64).
+ * Столбцы читаются memcpy, поэтому выравнивание не требуется; бонус за идею —
+ * маской сравнения, без ветвлений.
+ */
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+static void rate_offers(const OfferCols *c, int count) {
+    const Weights w = gWeights;
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        v4i s, co, d, id;
+        memcpy(&s, c->score + k, sizeof(s));
+        memcpy(&co, c->cost + k, sizeof(co));
+        memcpy(&d, c->duration + k, sizeof(d));
+        memcpy(&id, c->idea + k, sizeof(id));
+        v4i fav = (id == w.fav_idea);   // -1 там, где любимая категория
+        v4i r = s * w.score + co * w.cost + d * w.duration + (fav & w.idea);
+        memcpy(c->rating + k, &r, sizeof(r));
+    }
+    for (; k < count; ++k) {
+        c->rating[k] = rate_one(c->score[k], c->cost[k], c->duration[k], c->idea[k]);
+    }
+}
+
+// лучший ящик по рейтингу: векторный максимум, затем первый ящик с ним
+// (при равенстве побеждает меньший номер); -1, если все рейтинги INT_MIN
+static int best_offer(const OfferCols *c, int count) {
+    v4i m = { INT_MIN, INT_MIN, INT_MIN, INT_MIN };
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        v4i r;
+        memcpy(&r, c->rating + k, sizeof(r));
+        v4i gt = r > m;
+        m = (r & gt) | (m & ~gt);
+    }
+    int best = INT_MIN;
+    for (int l = 0; l < 4; ++l) {
+        if (m[l] > best) best = m[l];
+    }
+    for (; k < count; ++k) {
+        if (c->rating[k] > best) best = c->rating[k];
+    }
+    if (best == INT_MIN) return -1;
+    for (k = 0; k < count; ++k) {
+        if (c->rating[k] == best) return k;
+    }
+    return -1;
+}
+
+
+// публикация флага/эпохи: всё записанное до неё видно тому, кто её увидит
+static void flag_publish(atomic_int *f, int v) {
+    if (gOrder == ORDER_ACQ_REL) atomic_store_explicit(f, v, memory_order_release);
+    else atomic_store(f, v);
+}
+
+// прибавление к счётчику прибытия (release) / к счётчику, который читает последний (acq_rel)
+static int counter_add(atomic_int *c, int d, memory_order mo) {
+    if (gOrder == ORDER_ACQ_REL) return atomic_fetch_add_explicit(c, d, mo);
+    return atomic_fetch_add(c, d);
+}
+
+// опрос в цикле ожидания; после выхода из цикла нужен poll_acquire()
+static int poll_load(atomic_int *f) {
+    if (gOrder == ORDER_ACQ_REL) return atomic_load_explicit(f, POLL_ORDER);
+    return atomic_load(f);
+}
+
+static void poll_acquire(void) {
+#ifndef __SANITIZE_THREAD__
+    if (gOrder == ORDER_ACQ_REL) atomic_thread_fence(memory_order_acquire);
+#endif
+}
+
+/*
+ * Режим ожидания (--wait): spin — опрос флага и gStop с sched_yield;
+ * futex — поток спит в futex_waitv сразу на двух словах, своём флаге и gStop,
+ * и просыпается от того, что изменится первым. Поклонник так ждёт ответа,
+ * сервер — прибытия предложений, шард — ещё и итогового слияния. Будят их
+ * публикация флага (flag_publish_wake) и поток завершения — без опроса и без
+ * широковещания. На ядрах без futex_waitv (до 5.16) — FUTEX_WAIT на флаге
+ * с коротким таймаутом: остановка тогда замечается с задержкой до FUTEX_FALLBACK_MS.
+ */
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+#define FUTEX_FALLBACK_MS 10
+
+enum { WAITMODE_SPIN = 0, WAITMODE_FUTEX };
+
+static int gWaitMode = WAITMODE_SPIN;
+static int gHaveWaitv = 0;                      // ядро поддерживает futex_waitv
+static atomic_int gArrivals = 0;                // прибывшие предложения: на нём спит сервер
+
+// задержка от публикации ответа до пробуждения поклонника (--bench)
+static atomic_ullong gWakeNsSum = 0;
+static atomic_ullong gWakeNsMax = 0;
+static atomic_int gWakeCount = 0;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// пустой вызов: EINVAL (нет слов) — futex_waitv есть, ENOSYS — нет
+static void futex_probe(void) {
+    gHaveWaitv = syscall(SYS_futex_waitv, NULL, 0, 0, NULL, 0) < 0 && errno == EINVAL;
+}
+
+static void futex_wake(atomic_int *word) {
+    if (syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0) < 0) die_errno("futex(wake)");
+}
+
+// сон, пока *word == seen и gStop == 0, но не дольше абсолютного deadline (NULL — без него);
+// ложные пробуждения допустимы — вызывающий перепроверяет условие
+static void futex_wait_or_stop(atomic_int *word, int seen, const struct timespec *deadline) {
+    stat_inc(&gStats.futex_waits);
+    long rc;
+    if (gHaveWaitv) {
+        struct futex_waitv w[2] = {
+            { .val = (uint32_t)seen, .uaddr = (uintptr_t)word,   .flags = FUTEX_32 | FUTEX_PRIVATE_FLAG },
+            { .val = 0,              .uaddr = (uintptr_t)&gStop, .flags = FUTEX_32 | FUTEX_PRIVATE_FLAG },
+        };
+        rc = syscall(SYS_futex_waitv, w, 2, 0, deadline, CLOCK_MONOTONIC);
+    } else {
+        struct timespec rel = { 0, FUTEX_FALLBACK_MS * 1000000L };
+        if (deadline) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long left = (long)(deadline->tv_sec - now.tv_sec) * 1000000000L + (deadline->tv_nsec - now.tv_nsec);
+            if (left <= 0) return;
+            if (left < rel.tv_nsec) rel.tv_nsec = left;
+        }
+        rc = syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, &rel, NULL, 0);
+    }
+    if (rc < 0 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) die_errno("futex(wait)");
+}
+
+// публикация флага, на котором может спать поток; в режиме futex — с пробуждением
+static void flag_publish_wake(atomic_int *f) {
+    flag_publish(f, 1);
+    if (gWaitMode == WAITMODE_FUTEX) futex_wake(f);
+}
+
+// предложение прибыло: будим сервер, спящий на gArrivals (только в режиме futex)
+static void arrival_signal(void) {
+    if (gWaitMode != WAITMODE_FUTEX) return;
+    atomic_fetch_add(&gArrivals, 1);
+    futex_wake(&gArrivals);
+}
+
+// отметка времени публикации ответа (только для --bench)
+static uint64_t reply_stamp(void) {
+    return gBench ? mono_ns() : 0;
+}
+
+/*
+ * Цепочка пробуждений (--wake-chain K, только с --wait futex): вместо N вызовов
+ * FUTEX_WAKE подряд из потока сервера он будит лишь корни — поклонников 0..K-1,
+ * а каждый проснувшийся до разбора своего ответа будит детей в K-арном дереве
+ * ((id+1)*K .. (id+1)*K+K-1). Стоимость пробуждения так расходится по ядрам.
+ * Флаги ответов публикуются от старших id к младшим: увидев свой флаг, родитель
+ * знает, что флаги детей уже стоят. Детей опоздавших (им ответили раньше и
+ * отдельно) сервер будит сам.
+ */
+#define WAKE_CHAIN_MAX 64
+
+static int gWakeChain = 0;                      // K; 0 — сервер будит всех сам
+static uint64_t gFanoutStartNs = 0;             // начало рассылки ответов раунда (--bench)
+static atomic_ullong gFanoutLastNs = 0;         // последний поклонник, увидевший ответ
+static uint64_t gFanoutNsSum = 0;               // по всем раундам (пишет только main)
+static int gFanoutRounds = 0;
+
+// разбудить детей поклонника id (id = -1 — корни, их будит сервер)
+static void wake_chain_children(int id) {
+    int first = (id + 1) * gWakeChain;
+    for (int c = first; c < first + gWakeChain && c < gN; ++c) futex_wake(&gReplied[c]);
+}
+
+// поклонник увидел ответ рассылки: конец пробуждений в раунде
+static void fanout_seen(void) {
+    if (!gBench) return;
+    unsigned long long now = mono_ns();
+    unsigned long long prev = atomic_load_explicit(&gFanoutLastNs, memory_order_relaxed);
+    while (prev < now && !atomic_compare_exchange_weak_explicit(&gFanoutLastNs, &prev, now,
+                                                                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// поклонник получил ответ: учитываем задержку его пробуждения
+static void wake_latency_add(uint64_t sent_ns) {
+    if (!sent_ns) return;
+    uint64_t d = mono_ns() - sent_ns;
+    atomic_fetch_add_explicit(&gWakeNsSum, d, memory_order_relaxed);
+    atomic_fetch_add_explicit(&gWakeCount, 1, memory_order_relaxed);
+    unsigned long long prev = atomic_load_explicit(&gWakeNsMax, memory_order_relaxed);
+    while (prev < d && !atomic_compare_exchange_weak_explicit(&gWakeNsMax, &prev, d,
+                                                              memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/*
+ * Запись и воспроизведение порядка событий (--record FILE, --replay FILE).
+ * Запись: события протокола — отправка предложения (submit), сбор всех
+ * предложений сервером (collect), публикация ответа (reply) и прочтение ответа
+ * поклонником (wake) — попадают в общий массив раунда в порядке взятия слота,
+ * с временем от старта раунда и id потока ядра (gettid); после раунда main
+ * дописывает их в файл блоком "# round R N=.. SEED=..".
+ * Воспроизведение: из файла берутся порядок отправок и порядок прочтения
+ * ответов каждого раунда. Поклонник отправляет предложение только в свою
+ * очередь (счётчик хода, ожидание — опросом или на futex, как в --wait), сервер
+ * публикует ответы в записанном порядке прочтения, а поклонник, прочитав ответ,
+ * дожидается своей очереди. Так медленное чередование повторяется сколько
+ * угодно раз — под --bench, --perf или профилировщиком.
+ */
+enum { EV_SUBMIT = 0, EV_COLLECT, EV_REPLY, EV_WAKE, EV_KINDS };
+
+static const char *const kEventNames[EV_KINDS] = { "submit", "collect", "reply", "wake" };
+
+typedef struct {
+    uint64_t ts;                 // нс от старта раунда
+    int32_t tid;
+    int16_t kind;                // EV_*
+    int16_t id;                  // поклонник (-1 — событие сервера)
+} RecEvent;
+
+// событий на раунд: у каждого поклонника submit, reply и wake, плюс collect
+// каждого шарда — с запасом по четыре на поклонника
+#define REC_MAX_EVENTS (4 * 1000 + 16)
+
+static FILE *gRecordFile = NULL;          // --record FILE
+static RecEvent *gRecEvents = NULL;
+static atomic_int gRecCount = 0;
+static uint64_t gRecStartNs = 0;
+static int gRecWritten = 0;               // событий в файле (пишет только main)
+static _Thread_local int32_t tTid = 0;
+
+// записанный порядок одного раунда
+typedef struct {
+    int n;
+    unsigned seed;
+    int *submit, nsubmit;        // id в порядке отправки
+    int *wake, nwake;            // id в порядке прочтения ответа
+} ReplayRound;
+
+static const char *gReplayPath = NULL;    // --replay FILE
+static ReplayRound *gReplayRounds = NULL;
+static int gReplayCount = 0;
+static int *gReplaySubmitPos = NULL;      // очередь поклонника в раунде (-1 — без очереди)
+static int *gReplayWakePos = NULL;
+static const int *gReplayOrder = NULL;    // порядок публикации ответов (NULL — по id)
+static atomic_int gReplaySubmitTurn = 0;
+static atomic_int gReplayWakeTurn = 0;
+static int gReplayForced = 0;             // раундов сыграно по записи
+
+static void rec_event(int kind, int id) {
+    if (!gRecordFile) return;
+    if (!tTid) tTid = (int32_t)syscall(SYS_gettid);
+    int k = atomic_fetch_add_explicit(&gRecCount, 1, memory_order_relaxed);
+    if (k < REC_MAX_EVENTS) gRecEvents[k] = (RecEvent){ mono_ns() - gRecStartNs, tTid, (int16_t)kind, (int16_t)id };
+}
+
+static void rec_begin_round(void) {
+    if (!gRecordFile) return;
+    if (!gRecEvents) gRecEvents = (RecEvent*)xrealloc(NULL, REC_MAX_EVENTS * sizeof(RecEvent));
+    atomic_store(&gRecCount, 0);
+    gRecStartNs = mono_ns();
+}
+
+// события раунда — в файл (потоки раунда уже завершены)
+static void rec_flush_round(int round, unsigned seed) {
+    if (!gRecordFile) return;
+    static const char *wait_names[] = { "spin", "futex" };
+    int count = atomic_load(&gRecCount);
+    if (count > REC_MAX_EVENTS) count = REC_MAX_EVENTS;
+    fprintf(gRecordFile, "# round %d N=%d SEED=%u wait=%s events=%d\n", round, gN, seed, wait_names[gWaitMode], count);
+    for (int k = 0; k < count; ++k) {
+        const RecEvent *e = &gRecEvents[k];
+        fprintf(gRecordFile, "%llu\t%d\t%s\t%d\n", (unsigned long long)e->ts, e->tid, kEventNames[e->kind], e->id);
+    }
+    fflush(gRecordFile);
+    gRecWritten += count;
+}
+
+// чтение записи: блоки раундов с порядком отправок и прочтений; 0 — файл не годится
+static int replay_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) die_errno("fopen(replay)");
+    char line[256];
+    ReplayRound *cur = NULL;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), f)) {
+        int round, n;
+        unsigned seed;
+        unsigned long long ts;
+        int tid, id;
+        char kind[16];
+        if (sscanf(line, "# round %d N=%d SEED=%u", &round, &n, &seed) == 3) {
+            if (n < 1 || n > 1000) {
+                ok = 0;
+                break;
+            }
+            gReplayRounds = (ReplayRound*)xrealloc(gReplayRounds, (size_t)(gReplayCount + 1) * sizeof(ReplayRound));
+            cur = &gReplayRounds[gReplayCount++];
+            *cur = (ReplayRound){ .n = n, .seed = seed };
+            cur->submit = (int*)xrealloc(NULL, (size_t)n * sizeof(int));
+            cur->wake = (int*)xrealloc(NULL, (size_t)n * sizeof(int));
+        } else if (sscanf(line, "%llu %d %15s %d", &ts, &tid, kind, &id) == 4) {
+            if (!cur) {
+                ok = 0;
+            } else if (!strcmp(kind, "submit") || !strcmp(kind, "wake")) {
+                int *cnt = kind[0] == 's' ? &cur->nsubmit : &cur->nwake;
+                if (id < 0 || id >= cur->n || *cnt >= cur->n) ok = 0;
+                else (kind[0] == 's' ? cur->submit : cur->wake)[(*cnt)++] = id;
+            }
+        }
+    }
+    fclose(f);
+    if (ok && gReplayCount == 0) ok = 0;
+    return ok;
+}
+
+// раунд round по записи: очереди поклонников; номер и N/SEED должны совпасть
+static void replay_begin_round(int round, unsigned seed) {
+    free(gReplaySubmitPos);
+    free(gReplayWakePos);
+    gReplaySubmitPos = gReplayWakePos = NULL;
+    gReplayOrder = NULL;
+    if (!gReplayRounds) return;
+    if (round > gReplayCount) {
+        if (round == gReplayCount + 1) {
+            fprintf(stderr, "[REPLAY] %s has %d rounds, round %d and later run unforced\n",
+                    gReplayPath, gReplayCount, round);
+        }
+        return;
+    }
+    const ReplayRound *r = &gReplayRounds[round - 1];
+    if (r->n != gN || r->seed != seed) {
+        fprintf(stderr, "[REPLAY] round %d: recorded N=%d SEED=%u, running N=%d SEED=%u\n",
+                round, r->n, r->seed, gN, seed);
+        exit(1);
+    }
+    gReplaySubmitPos = (int*)xrealloc(NULL, (size_t)gN * sizeof(int));
+    gReplayWakePos = (int*)xrealloc(NULL, (size_t)gN * sizeof(int));
+    for (int i = 0; i < gN; ++i) gReplaySubmitPos[i] = gReplayWakePos[i] = -1;
+    for (int k = 0; k < r->nsubmit; ++k) gReplaySubmitPos[r->submit[k]] = k;
+    for (int k = 0; k < r->nwake; ++k) gReplayWakePos[r->wake[k]] = k;
+    // ответы в порядке прочтения — только если в записи их прочли все (без SIGINT)
+    if (r->nwake == gN) gReplayOrder = r->wake;
+    atomic_store(&gReplaySubmitTurn, 0);
+    atomic_store(&gReplayWakeTurn, 0);
+    ++gReplayForced;
+}
+
+// ждать своей очереди pos на счётчике хода (pos < 0 — без очереди)
+static void replay_wait_turn(atomic_int *turn, const int *pos, int id) {
+    if (!pos || pos[id] < 0) return;
+    for (;;) {
+        int seen = atomic_load(turn);
+        if (seen == pos[id] || poll_load(&gStop)) return;
+        if (gWaitMode == WAITMODE_FUTEX) futex_wait_or_stop(turn, seen, NULL);
+        else spin_yield();
+    }
+}
+
+static void replay_pass_turn(atomic_int *turn, const int *pos, int id) {
+    if (!pos || pos[id] < 0) return;
+    atomic_fetch_add(turn, 1);
+    if (gWaitMode == WAITMODE_FUTEX) futex_wake(turn);
+}
+
+/*
+ * Конфигурация (-c FILE): строки N=, SEED=, THINK_MIN=, THINK_MAX=, DEADLINE_MS=,
+ * LOG_LEVEL= и веса W_*. В режиме раундов (--rounds) файл отслеживается через inotify:
+ * поток завершения перечитывает его и откладывает в gPendingCfg, а main применяет
+ * новую конфигурацию только на границе раундов, когда потоков прошлого раунда уже нет.
+ */
+typedef struct {
+    int n;
+    unsigned seed;
+    int think_min, think_max;   // время обдумывания, с
+    int deadline_ms;            // 0 = ждать всех
+    int log_level;              // LOG_QUIET..LOG_DEBUG
+    Weights weights;
+} Config;
+
+static int gRounds = 1;                      // --rounds R: 0 = до SIGINT
+static const char *gCfgPath = NULL;
+static Config gBaseCfg;                      // значения ключей командной строки
+static int gInotifyFd = -1;                  // наблюдение за каталогом конфига
+static pthread_mutex_t gCfgLock = PTHREAD_MUTEX_INITIALIZER;
+static Config gPendingCfg;                   // перечитанный конфиг (под gCfgLock)
+static int gCfgPending = 0;
+
+// считываем построчно и обновляем поля c, если нашли подходящую строку;
+// 0 — файл не открылся (errno выставлен)
+static int read_config(const char *fname, Config *c) {
+    FILE *f = fopen(fname, "r");
+    if (!f) return 0;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        // убираем перевод строки
+        size_t len = strlen(line);
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        if (sscanf(line, "N=%d", &c->n) == 1) continue;
+        if (sscanf(line, "SEED=%u", &c->seed) == 1) continue;
+        if (sscanf(line, "THINK_MIN=%d", &c->think_min) == 1) continue;
+        if (sscanf(line, "THINK_MAX=%d", &c->think_max) == 1) continue;
+        if (sscanf(line, "DEADLINE_MS=%d", &c->deadline_ms) == 1) continue;
+        if (sscanf(line, "LOG_LEVEL=%d", &c->log_level) == 1) continue;
+
+        // веса многокритериальной оценки (проверяются в config_check)
+        if (sscanf(line, "W_SCORE=%d", &c->weights.score) == 1) continue;
+        if (sscanf(line, "W_COST=%d", &c->weights.cost) == 1) continue;
+        if (sscanf(line, "W_DURATION=%d", &c->weights.duration) == 1) continue;
+        if (sscanf(line, "W_IDEA=%d", &c->weights.idea) == 1) continue;
+        if (sscanf(line, "FAV_IDEA=%d", &c->weights.fav_idea) == 1) continue;
+    }
+
+    fclose(f);
+    return 1;
+}
+
+static int weights_default(const Weights *w) {
+    return w->score == 1 && w->cost == 0 && w->duration == 0 && w->idea == 0;
+}
+
+// проверка конфигурации против режимов командной строки; 0 — ошибка (текст в err)
+static int config_check(const Config *c, char *err, size_t size) {
+    const Weights *w = &c->weights;
+    if (abs(w->score) > WEIGHT_LIMIT || abs(w->cost) > WEIGHT_LIMIT ||
+        abs(w->duration) > WEIGHT_LIMIT || abs(w->idea) > WEIGHT_LIMIT) {
+        snprintf(err, size, "Weights must be in [-%d..%d]", WEIGHT_LIMIT, WEIGHT_LIMIT);
+        return 0;
+    }
+    if (w->fav_idea < 0 || w->fav_idea >= IDEAS_COUNT) {
+        snprintf(err, size, "FAV_IDEA must be in [0..%d]", IDEAS_COUNT - 1);
+        return 0;
+    }
+    if (gRankBench) return 1;   // замеру ядра оценки остальное не нужно
+
+    if (c->n < 1 || c->n > 1000) {
+        snprintf(err, size, "N must be in [1..1000]");
+        return 0;
+    }
+    if (gServers > c->n) {
+        snprintf(err, size, "--servers must not exceed N");
+        return 0;
+    }
+    if (c->think_min < 0 || c->think_min > c->think_max || c->think_max > THINK_LIMIT) {
+        snprintf(err, size, "THINK_MIN/THINK_MAX must satisfy 0 <= min <= max <= %d", THINK_LIMIT);
+        return 0;
+    }
+    if (c->deadline_ms < 0) {
+        snprintf(err, size, "DEADLINE_MS must not be negative");
+        return 0;
+    }
+    if (c->deadline_ms && (gTreeFanin || gServers > 1)) {
+        snprintf(err, size, "--deadline cannot be combined with --tree or --servers");
+        return 0;
+    }
+    if (gEarly && !weights_default(w)) {
+        // максимальный score перестаёт быть гарантированно лучшим
+        snprintf(err, size, "--early requires the default weights (W_SCORE=1, others 0)");
+        return 0;
+    }
+    if (c->log_level < LOG_QUIET || c->log_level > LOG_DEBUG) {
+        snprintf(err, size, "LOG_LEVEL must be in [%d..%d]", LOG_QUIET, LOG_DEBUG);
+        return 0;
+    }
+    return 1;
+}
+
+// проверенная конфигурация -> глобальные параметры (только когда потоков раунда нет)
+static void apply_config(const Config *c) {
+    gN = c->n;
+    gThinkMin = c->think_min;
+    gThinkMax = c->think_max;
+    gDeadlineMs = c->deadline_ms;
+    gLogLevel = c->log_level;
+    gWeights = c->weights;
+    gMultiCriteria = !weights_default(&gWeights);
+    atomic_store_explicit(&gStatsN, gN, memory_order_relaxed);
+}
+
+// событие inotify по каталогу конфига: если это наш файл — перечитываем от значений
+// командной строки и откладываем до следующего раунда; при ошибке остаётся прежний
+static void config_reload(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(gInotifyFd, buf, sizeof(buf));
+    if (len <= 0) return;
+
+    const char *name = strrchr(gCfgPath, '/');
+    name = name ? name + 1 : gCfgPath;
+    int ours = 0;
+    for (char *p = buf; p < buf + len;) {
+        const struct inotify_event *ev = (const struct inotify_event*)p;
+        if (ev->len && !strcmp(ev->name, name)) ours = 1;
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+    if (!ours) return;
+
+    Config c = gBaseCfg;
+    char err[128];
+    if (!read_config(gCfgPath, &c)) {
+        fprintf(stderr, "[CONFIG] %s: %s, keeping previous settings\n", gCfgPath, strerror(errno));
+        return;
+    }
+    if (!config_check(&c, err, sizeof(err))) {
+        fprintf(stderr, "[CONFIG] %s: %s, keeping previous settings\n", gCfgPath, err);
+        return;
+    }
+
+    pthread_mutex_lock(&gCfgLock);
+    gPendingCfg = c;
+    gCfgPending = 1;
+    pthread_mutex_unlock(&gCfgLock);
+    stat_inc(&gStats.reloads);
+    fprintf(stderr, "[CONFIG] reloaded %s: N=%d SEED=%u think=%d..%ds deadline_ms=%d log_level=%d "
+                    "(applies from the next round)\n",
+            gCfgPath, c.n, c.seed, c.think_min, c.think_max, c.deadline_ms, c.log_level);
+}
+
+// отложенная конфигурация для main на границе раундов; 0 — изменений нет
+static int take_pending_config(Config *out) {
+    pthread_mutex_lock(&gCfgLock);
+    int pending = gCfgPending;
+    if (pending) *out = gPendingCfg;
+    gCfgPending = 0;
+    pthread_mutex_unlock(&gCfgLock);
+    return pending;
+}
+
+// каталог файла path ("." для имени без каталога) — inotify следит за каталогом,
+// чтобы пережить замену файла через rename (так сохраняют редакторы)
+static void watch_config(const char *path) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+
+    gInotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (gInotifyFd < 0) die_errno("inotify_init1");
+    if (inotify_add_watch(gInotifyFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) die_errno("inotify_add_watch");
+}
+
+// поток завершения: ждёт SIGINT (signalfd) или просьбу main выйти (gQuitFd);
+// SIGUSR1 приходит в тот же signalfd — пишем снимок счётчиков и ждём дальше;
+// в режиме раундов здесь же принимаются события inotify по конфигу
+static void *shutdown_thread(void *arg) {
+    int sfd = *(int*)arg;
+    struct pollfd fds[3] = {
+        { .fd = sfd,        .events = POLLIN },
+        { .fd = gQuitFd,    .events = POLLIN },
+        { .fd = gInotifyFd, .events = POLLIN },   // -1 (без наблюдения) poll пропускает
+    };
+
+    struct signalfd_siginfo si;
+    for (;;) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            die_errno("poll(shutdown)");
+        }
+        if (fds[1].revents & POLLIN) return NULL;
+        if (fds[2].revents & POLLIN) config_reload();
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        if (read(sfd, &si, sizeof(si)) != (ssize_t)sizeof(si)) die_errno("read(signalfd)");
+        if (si.ssi_signo != SIGUSR1) break;
+        stat_inc(&gStats.snapshots);
+        dump_stats();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &gSigintAt);
+
+    atomic_store(&gStop, 1);
+    if (gWaitMode == WAITMODE_FUTEX) futex_wake(&gStop);
+    uint64_t one = 1;
+    if (write(gStopFd, &one, sizeof(one)) != (ssize_t)sizeof(one)) die_errno("write(eventfd)");
+    return NULL;
+}
+
+enum { WAIT_TIMEOUT = 0, WAIT_STOPPED = 1, WAIT_RELEASED = 2 };
+
+// пауза на ms миллисекунд, прерываемая остановкой (WAIT_STOPPED); если задан state —
+// ещё и досрочным решением, закрывшим приём у этого поклонника (WAIT_RELEASED)
+static int wait_ms(int ms, atomic_int *state) {
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = gStopFd,    .events = POLLIN },
+        { .fd = gReleaseFd, .events = POLLIN },
+    };
+    while (!atomic_load(&gStop)) {
+        if (state && atomic_load(state) == SUBMIT_LATE) return WAIT_RELEASED;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = (long)(deadline.tv_sec - now.tv_sec) * 1000L +
+                    (deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+        if (left <= 0) return WAIT_TIMEOUT;
+        stat_inc(&gStats.timed_waits);
+        if (poll(fds, state ? 2 : 1, (int)left) < 0 && errno != EINTR) die_errno("poll(stop)");
+    }
+    return WAIT_STOPPED;
+}
+
+// пауза на ms миллисекунд, прерываемая остановкой; 1 — если прервана
+static int stop_wait_ms(int ms) {
+    return wait_ms(ms, NULL);
+}
+
+// ключ для сравнения предложений: больший рейтинг, при равенстве — меньший id
+// (умножение, а не сдвиг: рейтинг с весами может быть отрицательным)
+static long long tree_key(int score, int id) {
+    return (long long)score * 4294967296LL + (long long)(0xFFFFFFFFu - (unsigned)id);
+}
+
+static int tree_key_id(long long key) {
+    return (int)(0xFFFFFFFFu - (unsigned)(key & 0xFFFFFFFFll));
+}
+
+static int tree_key_score(long long key) {
+    return (int)(key >> 32);
+}
+
+// прибытие поклонника в дерево: вливаем ключ в узел (CAS-максимум), последний
+// пришедший в узел поднимается выше с накопленным максимумом
+static void tree_arrive(int id, int score) {
+    long long key = tree_key(score, id);
+    int node = id / gTreeFanin;
+
+    for (;;) {
+        TreeNode *t = &gTree[node];
+        // CAS-максимум может быть relaxed: его "публикует" следующий за ним fetch_add
+        memory_order mo = (gOrder == ORDER_ACQ_REL) ? memory_order_relaxed : memory_order_seq_cst;
+        long long cur = atomic_load_explicit(&t->best, mo);
+        while (key > cur && !atomic_compare_exchange_weak_explicit(&t->best, &cur, key, mo, mo)) {
+        }
+        if (counter_add(&t->arrived, 1, memory_order_acq_rel) + 1 < t->expected) return;
+
+        // последний в узле: все дети уже влили свои ключи до fetch_add
+        key = atomic_load_explicit(&t->best, mo);
+        if (t->parent < 0) {
+            flag_publish(&gTreeDone, 1);
+            return;
+        }
+        node = t->parent;
+    }
+}
+
+// построение дерева: листья по gTreeFanin поклонников, далее уровни по gTreeFanin узлов
+static void setup_tree(void) {
+    int total = 0;
+    for (int width = (gN + gTreeFanin - 1) / gTreeFanin; ; width = (width + gTreeFanin - 1) / gTreeFanin) {
+        total += width;
+        if (width == 1) break;
+    }
+
+    gTree = (TreeNode*)aligned_alloc(64, sizeof(TreeNode) * (size_t)total);
+    if (!gTree) die_errno("aligned_alloc(tree)");
+
+    int children = gN;  // число элементов предыдущего уровня (сначала поклонники)
+    int base = 0;       // индекс первого узла текущего уровня
+    for (;;) {
+        int width = (children + gTreeFanin - 1) / gTreeFanin;
+        for (int k = 0; k < width; ++k) {
+            TreeNode *t = &gTree[base + k];
+            atomic_init(&t->arrived, 0);
+            atomic_init(&t->best, LLONG_MIN);
+            t->expected = (k == width - 1) ? children - k * gTreeFanin : gTreeFanin;
+            t->parent = (width == 1) ? -1 : base + width + k / gTreeFanin;
+        }
+        if (width == 1) break;
+        base += width;
+        children = width;
+    }
+    gTreeRoot = base;
+    atomic_init(&gTreeDone, 0);
+}
+
+// ящик для предложения/ответа поклонника id (в шардированном режиме — в ящиках шарда)
+static Offer *offer_slot(int id) {
+    if (gShards) return &gShards[gShardOf[id]].offers[gSlotOf[id]];
+    return &gOffers[id];
+}
+
+static Reply *reply_slot(int id) {
+    if (gShards) return &gShards[gShardOf[id]].replies[gSlotOf[id]];
+    return &gReplies[id];
+}
+
+// флаг ответа поклоннику id: в шардированном режиме ответы публикуются
+// одной эпохой на весь шард, а не флагом на каждого поклонника
+static atomic_int *reply_word(int id) {
+    if (gShards) return &gShards[gShardOf[id]].reply_epoch;
+    return &gReplied[id];
+}
+
+static int reply_ready(int id) {
+    return poll_load(reply_word(id)) != 0;
+}
+
+
+// отметка "предложение отправлено"; 0 — если сервер уже закрыл приём (дедлайн, досрочно)
+static int submit_offer(int id) {
+    if (!gDeadlineMs && !gEarly) {
+        flag_publish(&gSubmitted[id], SUBMIT_DONE);
+        return 1;
+    }
+    int expected = SUBMIT_PENDING;
+    if (gOrder == ORDER_ACQ_REL) {
+        return atomic_compare_exchange_strong_explicit(&gSubmitted[id], &expected, SUBMIT_DONE,
+                                                       memory_order_acq_rel, memory_order_acquire);
+    }
+    return atomic_compare_exchange_strong(&gSubmitted[id], &expected, SUBMIT_DONE);
+}
+
+// дедлайн прошёл или решение принято досрочно: закрываем приём у всех,
+// кто ещё не отправил; возвращает их число
+static int close_submissions(void) {
+    int late = 0;
+    for (int i = 0; i < gN; ++i) {
+        int expected = SUBMIT_PENDING;
+        if (atomic_compare_exchange_strong(&gSubmitted[i], &expected, SUBMIT_LATE)) ++late;
+    }
+    return late;
+}
+
+// момент now + ms (CLOCK_MONOTONIC)
+static struct timespec deadline_after_ms(int ms) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    return t;
+}
+
+static int deadline_passed(const struct timespec *d) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > d->tv_sec || (now.tv_sec == d->tv_sec && now.tv_nsec >= d->tv_nsec);
+}
+
+// поклонник начал работу: последний фиксирует момент "все запущены";
+// в режиме --launchers поклонник ждёт открытия стартового шлюза
+static void fan_started(void) {
+    if (!gLaunchers) {
+        if (atomic_fetch_add(&gRunning, 1) + 1 == gN) clock_gettime(CLOCK_MONOTONIC, &gAllRunningAt);
+        return;
+    }
+
+    pthread_mutex_lock(&gGateLock);
+    if (atomic_fetch_add(&gRunning, 1) + 1 == gN) {
+        clock_gettime(CLOCK_MONOTONIC, &gAllRunningAt);
+        gGateOpen = 1;
+        pthread_cond_broadcast(&gGateCond);
+    }
+    while (!gGateOpen) {
+        stat_inc(&gStats.cond_waits);
+        pthread_cond_wait(&gGateCond, &gGateLock);
+    }
+    pthread_mutex_unlock(&gGateLock);
+}
+
+static void fan_run(const FanArgs *a) {
+    int id = a->fan_id;
+    log_thread_init(id);
+
+    fan_started();
+
+    perf_phase(PH_THINK);
+    // "думает" над предложением (имитация параллельного поведения);
+    // случайные параметры поклонника сгенерированы заранее пакетом (gen_fan_params)
+    int think = gParams.think[id];
+    // если нажали Ctrl+C — корректно выходим (ожидание прерывается сразу);
+    // досрочное решение тоже прерывает обдумывание — отправлять уже некому
+    int woke = wait_ms(think * gThinkUnitMs, gEarly ? &gSubmitted[id] : NULL);
+    if (woke == WAIT_STOPPED) {
+        LOG(LOG_FANS, "[Клиент %02d] Прервано (SIGINT) во время обдумывания.\n", id);
+        return;
+    }
+
+    // формируем предложение
+    perf_phase(PH_SUBMIT);
+    Offer offer;
+    offer.fan_id = id;
+    offer.score = gParams.score[id];
+    snprintf(offer.text, sizeof(offer.text), "%s", kIdeas[gParams.idea[id]]);
+    offer.lts = log_stamp();
+    int rating = rate_one(offer.score, gParams.cost[id], gParams.duration[id], gParams.idea[id]);
+
+    // атрибуты — в столбцы своего ящика (у сервера или шарда)
+    OfferCols *cols = gShards ? &gShards[gShardOf[id]].cols : &gCols;
+    int box = gShards ? gSlotOf[id] : id;
+    cols->score[box] = offer.score;
+    cols->cost[box] = gParams.cost[id];
+    cols->duration[box] = gParams.duration[id];
+    cols->idea[box] = gParams.idea[id];
+
+    // отправка запроса "на сервер":
+    // кладём предложение в свой слот и отмечаем флаг отправки
+    // (если приём уже закрыт, CAS не пройдёт — причину поклонник узнает из ответа)
+    *offer_slot(id) = offer;
+    if (woke == WAIT_TIMEOUT) replay_wait_turn(&gReplaySubmitTurn, gReplaySubmitPos, id);
+    if (woke == WAIT_TIMEOUT && submit_offer(id)) {
+        rec_event(EV_SUBMIT, id);
+        if (gShards) {
+            Shard *sh = &gShards[gShardOf[id]];
+            counter_add(&sh->arrived, 1, memory_order_release);
+            if (gWaitMode == WAITMODE_FUTEX) futex_wake(&sh->arrived);
+        }
+        if (gQueueMode) {
+            while (!queue_push(&gQueue, id)) spin_yield();
+        }
+        if (gTree) tree_arrive(id, rating);
+        stat_inc(&gStats.submitted);
+
+        if (gMultiCriteria) {
+            LOG(LOG_FANS, "[Клиент %02d] Отправил валентинку: score=%d, стоимость=%d, %dч, идея='%s' "
+                          "(рейтинг=%d, думал %dс)\n",
+                          id, offer.score, gParams.cost[id], gParams.duration[id], offer.text, rating, think);
+        } else {
+            LOG(LOG_FANS, "[Клиент %02d] Отправил валентинку: score=%d, идея='%s' (думал %dс)\n",
+                          id, offer.score, offer.text, think);
+        }
+
+        // максимальный score: заявляемся на досрочное решение (побеждает первый CAS)
+        if (gEarly && offer.score == SCORE_MAX) {
+            int none = -1;
+            atomic_compare_exchange_strong(&gEarlyId, &none, id);
+        }
+        if (!gShards) arrival_signal();
+    }
+    if (woke == WAIT_TIMEOUT) replay_pass_turn(&gReplaySubmitTurn, gReplaySubmitPos, id);
+
+    // ожидание ответа (опрос своего gReplied[id] или сон на нём — это и меряет фаза reply):
+    // по условию поклонник получает ответ только после того, как все отправили предложения
+    perf_phase(PH_REPLY);
+    int waited = 0;   // итераций ожидания (0 — ответ пришёл ещё во время обдумывания)
+    while (!reply_ready(id)) {
+        ++waited;
+        if (poll_load(&gStop)) {
+            LOG(LOG_FANS, "[Клиент %02d] Прервано (SIGINT) во время ожидания ответа.\n", id);
+            return;
+        }
+        if (gWaitMode == WAITMODE_FUTEX) {
+            futex_wait_or_stop(reply_word(id), 0, NULL);
+        } else {
+            // отдаём квант процессора, чтобы не "жечь" CPU полностью
+            spin_yield();
+        }
+    }
+    poll_acquire();
+
+    // получаем ответ (студентка заполнила gReplies[id] или ящик шарда)
+    Reply rep = *reply_slot(id);
+    stat_inc(&gStats.replied);
+    if (waited) wake_latency_add(rep.sent_ns);
+    // ответ общей рассылки: сначала будим своих детей, потом разбираем свой
+    if (!rep.late && !gShards) {
+        if (gWakeChain) wake_chain_children(id);
+        fanout_seen();
+    }
+    replay_wait_turn(&gReplayWakeTurn, gReplayWakePos, id);
+    rec_event(EV_WAKE, id);
+    replay_pass_turn(&gReplayWakeTurn, gReplayWakePos, id);
+    log_recv(rep.lts);
+    LOG(LOG_DEBUG, "[Клиент %02d] Ответ после %d итераций ожидания (%s)\n",
+                   id, waited, gWaitMode == WAITMODE_FUTEX ? "futex" : "spin");
+
+    // предметная реакция клиента
+    if (rep.late == LATE_EARLY) {
+        LOG(LOG_FANS, "[Клиент %02d] Ответ: Решение принято досрочно — выбран %02d (best_score=%d)\n",
+                      id, rep.winner_id, rep.best_score);
+    } else if (rep.late) {
+        LOG(LOG_FANS, "[Клиент %02d] Опоздал с валентинкой: дедлайн прошёл (думал %dс)\n", id, think);
+        if (rep.winner_id < 0) {
+            LOG(LOG_FANS, "[Клиент %02d] Ответ: Слишком поздно — к дедлайну никто не успел\n", id);
+        } else {
+            LOG(LOG_FANS, "[Клиент %02d] Ответ: Слишком поздно — уже выбран %02d (best_score=%d)\n",
+                          id, rep.winner_id, rep.best_score);
+        }
+    } else if (rep.accepted) {
+        LOG(LOG_FANS, "[Клиент %02d] Ответ: Принято! (best_score=%d)\n", id, rep.best_score);
+    } else {
+        // если winner_id < 0 — значит завершение по SIGINT
+        if (rep.winner_id < 0) {
+            LOG(LOG_FANS, "[Клиент %02d] Ответ: Отказ. (работа остановлена пользователем)\n", id);
+        } else {
+            LOG(LOG_FANS, "[Клиент %02d] Ответ: Отказ. Победил %02d (best_score=%d). Реакция: '%s'\n",
+                          id, rep.winner_id, rep.best_score,
+                          (rating + 10 < rep.best_score) ? "надо было стараться(" : "обидно, почти выиграл!");
+        }
+    }
+}
+
+// поток поклонника: протокол в fan_run, вокруг — счётчики --perf
+static void *fan_thread(void *arg) {
+    perf_thread_begin(PERF_FAN);
+    fan_run((const FanArgs*)arg);
+    perf_thread_end();
+    return NULL;
+}
+
+// если работа прервана, всем выдаём отказ и помечаем, что ответ готов
+static void send_abort_replies(void) {
+    for (int i = 0; i < gN; ++i) {
+        gReplies[i].accepted = 0;
+        gReplies[i].winner_id = -1;
+        gReplies[i].best_score = -1;
+        gReplies[i].lts = log_stamp();
+        gReplies[i].sent_ns = reply_stamp();
+        flag_publish_wake(&gReplied[i]);
+    }
+}
+
+// текущие итоги по разобранной части очереди (--queue)
+typedef struct {
+    int count;                 // разобрано предложений
+    long long score_sum;
+    int score_min, score_max;
+    int best_id, best_rating;  // лидер: максимальный рейтинг, при равенстве — меньший id
+} StreamStats;
+
+// разбор всего, что уже лежит в очереди; возвращает число разобранных
+static int queue_drain(StreamStats *st) {
+    int id, got = 0;
+    while (queue_pop(&gQueue, &id)) {
+        const Offer *o = &gOffers[id];
+        log_recv(o->lts);
+        int rating = rate_one(o->score, gParams.cost[id], gParams.duration[id], gParams.idea[id]);
+        if (st->count == 0 || o->score < st->score_min) st->score_min = o->score;
+        if (st->count == 0 || o->score > st->score_max) st->score_max = o->score;
+        st->score_sum += o->score;
+        st->count++;
+        if (st->best_id < 0 || rating > st->best_rating || (rating == st->best_rating && id < st->best_id)) {
+            st->best_id = id;
+            st->best_rating = rating;
+        }
+        LOG(LOG_SERVER, "[Сервер] Валентинка #%d от клиента %02d: score=%d, рейтинг=%d; лидер %02d (%d), "
+                        "средний score=%.1f\n", st->count, id, o->score, rating, st->best_id, st->best_rating,
+                        (double)st->score_sum / st->count);
+        ++got;
+    }
+    return got;
+}
+
+static void girl_run(void) {
+    log_thread_init(LOG_SRC_SERVER);
+
+    LOG(LOG_SERVER, "[Сервер] Студентка: жду все валентинки...\n");
+
+    struct timespec deadline = deadline_after_ms(gDeadlineMs);
+    int closed = 0;   // приём закрыт раньше времени: LATE_DEADLINE или LATE_EARLY
+    StreamStats stream = { .best_id = -1 };
+    perf_phase(PH_COLLECT);
+
+    // ждём, пока все N клиентов выставят submitted[i] (активно или сном на gArrivals)
+    int polls = 0;
+    for (;;) {
+        ++polls;
+        // счётчик снимаем до проверок: прибытие после них разбудит сразу
+        int seen = atomic_load(&gArrivals);
+        // если прервали по Ctrl+C — сразу рассылаем отказ и выходим
+        if (poll_load(&gStop)) {
+            LOG(LOG_SERVER, "[Сервер] Получен SIGINT. Рассылаю всем отказ и завершаю.\n");
+            send_abort_replies();
+            return;
+        }
+        // пока ждём остальных — разбираем уже пришедшие (и не засыпаем, если что-то было)
+        if (gQueueMode && queue_drain(&stream)) continue;
+
+        // в режиме дерева достаточно одного флага корня
+        int ready = 1;
+        if (gTree) {
+            ready = poll_load(&gTreeDone);
+        } else {
+            for (int i = 0; i < gN; ++i) {
+                if (!poll_load(&gSubmitted[i])) { ready = 0; break; }
+            }
+        }
+        if (ready) break;
+
+        // пришёл максимальный score: дальше ждать бессмысленно
+        if (gEarly && poll_load(&gEarlyId) >= 0) closed = LATE_EARLY;
+        // дедлайн: закрываем приём, выбираем среди успевших
+        else if (gDeadlineMs && deadline_passed(&deadline)) closed = LATE_DEADLINE;
+
+        if (closed) {
+            gLateCount = close_submissions();
+            gClosedBy = closed;
+            if (closed == LATE_EARLY) {
+                // будим всех, кто ещё думает (их флаг уже SUBMIT_LATE)
+                clock_gettime(CLOCK_MONOTONIC, &gDecidedAt);
+                uint64_t one = 1;
+                if (write(gReleaseFd, &one, sizeof(one)) != (ssize_t)sizeof(one)) die_errno("write(eventfd)");
+            }
+            break;
+        }
+
+        if (gWaitMode == WAITMODE_FUTEX) futex_wait_or_stop(&gArrivals, seen, gDeadlineMs ? &deadline : NULL);
+        else spin_yield();
+    }
+    poll_acquire();
+    perf_phase(PH_SELECT);
+    rec_event(EV_COLLECT, -1);
+    LOG(LOG_DEBUG, "[Сервер] Сбор предложений: %d проходов цикла ожидания\n", polls);
+
+    // хвост очереди: отправившие, но ещё не успевшие положить id (таких единицы)
+    int streamed = stream.count;
+    if (gQueueMode) {
+        int expected = closed ? gN - gLateCount : gN;
+        while (stream.count < expected) {
+            if (!queue_drain(&stream)) spin_yield();
+        }
+    }
+
+    // логические часы: получены все успевшие предложения (с --queue — уже при разборе)
+    if (gOrderedLog && !gQueueMode) {
+        for (int i = 0; i < gN; ++i) {
+            if (atomic_load(&gSubmitted[i]) == SUBMIT_DONE) log_recv(gOffers[i].lts);
+        }
+    }
+
+    if (closed == LATE_EARLY) {
+        LOG(LOG_SERVER, "[Сервер] Пришло предложение с score=%d — решаю досрочно (не дождалась %d из %d)\n",
+                        SCORE_MAX, gLateCount, gN);
+    } else if (closed) {
+        LOG(LOG_SERVER, "[Сервер] Дедлайн %d мс: не успели %d из %d. Выбираю среди пришедших...\n",
+                        gDeadlineMs, gLateCount, gN);
+    } else {
+        LOG(LOG_SERVER, "[Сервер] Все валентинки получены. Выбираю лучшее предложение...\n");
+    }
+
+    // выбираем предложение с максимальным рейтингом (взвешенная сумма атрибутов)
+    // (в режиме дерева максимум уже собран в корне; после дедлайна — только среди успевших)
+    int best_id = -1;
+    int best_score = -1;
+    if (gTree) {
+        long long root = atomic_load(&gTree[gTreeRoot].best);
+        best_id = tree_key_id(root);
+        best_score = tree_key_score(root);
+    } else if (gQueueMode) {
+        // рейтинг уже посчитан по мере прибытия; в очереди только успевшие
+        best_id = stream.best_id;
+        if (closed == LATE_EARLY && gEarly == EARLY_FIRST) best_id = atomic_load(&gEarlyId);
+        if (best_id >= 0) {
+            best_score = rate_one(gOffers[best_id].score, gParams.cost[best_id],
+                                  gParams.duration[best_id], gParams.idea[best_id]);
+        }
+    } else {
+        rate_offers(&gCols, gN);
+        if (closed) {
+            for (int i = 0; i < gN; ++i) {
+                if (atomic_load(&gSubmitted[i]) != SUBMIT_DONE) gCols.rating[i] = INT_MIN;
+            }
+        }
+        best_id = best_offer(&gCols, gN);
+        // lowest — это и есть обычный выбор (первый с максимумом); first — заявка по CAS
+        if (closed == LATE_EARLY && gEarly == EARLY_FIRST) best_id = atomic_load(&gEarlyId);
+        if (best_id >= 0) best_score = gCols.rating[best_id];
+    }
+
+    if (gQueueMode && stream.count > 0) {
+        LOG(LOG_SERVER, "[Сервер] Разобрано в порядке прибытия: %d (до закрытия приёма — %d), "
+                        "score мин/средн/макс = %d/%.1f/%d\n", stream.count, streamed,
+                        stream.score_min, (double)stream.score_sum / stream.count, stream.score_max);
+    }
+
+    // сохраняем итог для main
+    atomic_store(&gWinnerId, best_id);
+    atomic_store(&gBestScore, best_score);
+
+    // опоздавшим отвечаем сразу, не дожидаясь паузы на выбор
+    if (closed) {
+        for (int i = 0; i < gN; ++i) {
+            if (atomic_load(&gSubmitted[i]) != SUBMIT_LATE) continue;
+            gReplies[i].accepted = 0;
+            gReplies[i].winner_id = best_id;
+            gReplies[i].best_score = best_score;
+            gReplies[i].late = closed;
+            gReplies[i].lts = log_stamp();
+            gReplies[i].sent_ns = reply_stamp();
+            flag_publish_wake(&gReplied[i]);
+            rec_event(EV_REPLY, i);
+        }
+    }
+
+    // имитация времени выбора (при досрочном решении выбирать не из чего — отвечаем сразу)
+    if (closed != LATE_EARLY && stop_wait_ms(gThinkUnitMs)) {
+        LOG(LOG_SERVER, "[Сервер] SIGINT во время выбора. Рассылаю отказ и завершаю.\n");
+        send_abort_replies();
+        return;
+    }
+
+    if (best_id >= 0 && gMultiCriteria) {
+        LOG(LOG_SERVER, "[Сервер] Выбрано предложение клиента %02d: рейтинг=%d (score=%d, стоимость=%d, %dч), идея='%s'\n",
+                        best_id, best_score, gOffers[best_id].score, gParams.cost[best_id],
+                        gParams.duration[best_id], gOffers[best_id].text);
+    } else if (best_id >= 0) {
+        LOG(LOG_SERVER, "[Сервер] Выбрано предложение клиента %02d: score=%d, идея='%s'\n",
+                        best_id, best_score, gOffers[best_id].text);
+    } else {
+        LOG(LOG_SERVER, "[Сервер] К дедлайну не пришло ни одной валентинки.\n");
+    }
+
+    // рассылка ответов всем клиентам (опоздавшим уже ответили)
+    perf_phase(PH_REPLY);
+    if (gBench) gFanoutStartNs = mono_ns();
+    if (!gWakeChain) {
+        // при воспроизведении — в записанном порядке прочтения
+        for (int k = 0; k < gN; ++k) {
+            int i = gReplayOrder ? gReplayOrder[k] : k;
+            if (closed && gReplies[i].late) continue;
+            gReplies[i].accepted = (i == best_id) ? 1 : 0;
+            gReplies[i].winner_id = best_id;
+            gReplies[i].best_score = best_score;
+            gReplies[i].lts = log_stamp();
+            gReplies[i].sent_ns = reply_stamp();
+            flag_publish_wake(&gReplied[i]);
+            rec_event(EV_REPLY, i);
+        }
+    } else {
+        // ответы — в прежнем порядке (те же логические метки), флаги — с конца, без пробуждений
+        for (int i = 0; i < gN; ++i) {
+            if (closed && gReplies[i].late) continue;
+            gReplies[i].accepted = (i == best_id) ? 1 : 0;
+            gReplies[i].winner_id = best_id;
+            gReplies[i].best_score = best_score;
+            gReplies[i].lts = log_stamp();
+            gReplies[i].sent_ns = reply_stamp();
+        }
+        for (int i = gN - 1; i >= 0; --i) {
+            if (closed && gReplies[i].late) continue;
+            flag_publish(&gReplied[i], 1);
+            rec_event(EV_REPLY, i);
+        }
+        wake_chain_children(-1);
+        for (int i = 0; closed && i < gN; ++i) {
+            if (gReplies[i].late) wake_chain_children(i);
+        }
+    }
+
+    LOG(LOG_SERVER, "[Сервер] Ответы разосланы всем. Завершаю работу.\n");
+}
+
+static void *girl_thread(void *arg) {
+    (void)arg;
+    perf_thread_begin(PERF_SERVER);
+    girl_run();
+    perf_thread_end();
+    return NULL;
+}
+
+// разбор списка ядер вида "0-3,8-11" (формат sysfs): помечаем их узлом node
+static void parse_cpulist(const char *list, int node) {
+    const char *p = list;
+    while (*p) {
+        char *end = NULL;
+        long lo = strtol(p, &end, 10);
+        if (end == p) break;
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long c = lo; c <= hi; ++c) {
+            for (int k = 0; k < gCpuCount; ++k) {
+                if (gCpus[k] == (int)c) gCpuNode[k] = node;
+            }
+        }
+        if (*p == ',') ++p;
+        else break;
+    }
+}
+
+// топология: доступные процессу ядра и их NUMA-узлы (если sysfs недоступен — один узел)
+static void init_topology(void) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) die_errno("sched_getaffinity");
+    gAllowedCpus = set;
+
+    gCpuCount = CPU_COUNT(&set);
+    gCpus = (int*)calloc((size_t)gCpuCount, sizeof(int));
+    gCpuNode = (int*)calloc((size_t)gCpuCount, sizeof(int));
+    gCpuReserved = (unsigned char*)calloc((size_t)gCpuCount, 1);
+    if (!gCpus || !gCpuNode || !gCpuReserved) die_errno("calloc(topology)");
+
+    for (int c = 0, k = 0; k < gCpuCount; ++c) {
+        if (CPU_ISSET(c, &set)) gCpus[k++] = c;
+    }
+
+    gNodeCount = 1;
+    for (int node = 0; node < CPU_SETSIZE; ++node) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (!f) break;
+        char line[1024];
+        if (fgets(line, sizeof(line), f)) parse_cpulist(line, node);
+        fclose(f);
+        gNodeCount = node + 1;
+    }
+}
+
+// первое свободное ядро на узле node (или любое свободное, если на узле всё занято)
+static int pick_free_cpu(int node) {
+    for (int k = 0; k < gCpuCount; ++k) {
+        if (!gCpuReserved[k] && gCpuNode[k] == node) return k;
+    }
+    for (int k = 0; k < gCpuCount; ++k) {
+        if (!gCpuReserved[k]) return k;
+    }
+    return -1;
+}
+
+// план размещения серверов: по одному ядру на сервер, одно ядро (если есть)
+// оставляем поклонникам; в режиме numa серверы разносим по узлам
+static void plan_servers(int servers) {
+    for (int s = 0; s < servers; ++s) {
+        int node = (gPinMode == PIN_NUMA) ? s % gNodeCount : 0;
+        int k = pick_free_cpu(node);
+        if (k < 0 || s >= gCpuCount - 1) k = s % gCpuCount;
+        gServerCpu[s] = k;
+        if (gCpuCount > 1 && s < gCpuCount - 1) gCpuReserved[k] = 1;
+    }
+}
+
+// ядро для поклонника i (индекс в gCpus) или -1, если поклонник не закрепляется
+static int fan_cpu(int i) {
+    if (gPinMode == PIN_NONE) return -1;
+
+    int free_cnt = 0;
+    for (int k = 0; k < gCpuCount; ++k) free_cnt += !gCpuReserved[k];
+    if (free_cnt == 0) return i % gCpuCount;
+
+    int node = -1;   // узел, на котором нужно разместить поклонника
+    int rank = i;    // порядковый номер поклонника среди претендентов на узел
+    if (gPinMode == PIN_NUMA) {
+        if (gShards) {
+            node = gCpuNode[gShards[gShardOf[i]].cpu];
+            rank = gSlotOf[i];
+        } else {
+            node = i % gNodeCount;
+            rank = i / gNodeCount;
+        }
+        int on_node = 0;
+        for (int k = 0; k < gCpuCount; ++k) on_node += !gCpuReserved[k] && gCpuNode[k] == node;
+        if (on_node == 0) node = -1;
+        else free_cnt = on_node;
+    }
+
+    int want = rank % free_cnt;
+    for (int k = 0; k < gCpuCount; ++k) {
+        if (gCpuReserved[k] || (node >= 0 && gCpuNode[k] != node)) continue;
+        if (want-- == 0) return k;
+    }
+    return -1;
+}
+
+// атрибуты потоков: размер стека и защитной зоны задаются один раз,
+// перед каждым pthread_create меняется только привязка к ядру
+static void init_thread_attrs(pthread_attr_t *attr) {
+    int rc = pthread_attr_init(attr);
+    die_pthread(rc, "pthread_attr_init");
+    if (gStackKb > 0) {
+        rc = pthread_attr_setstacksize(attr, gStackKb * 1024);
+        die_pthread(rc, "pthread_attr_setstacksize");
+    }
+    if (gGuardKb != (size_t)-1) {
+        rc = pthread_attr_setguardsize(attr, gGuardKb * 1024);
+        die_pthread(rc, "pthread_attr_setguardsize");
+    }
+}
+
+// атрибуты для очередного потока (k — индекс ядра в gCpus, -1 — без привязки)
+static pthread_attr_t *thread_attr(pthread_attr_t *attr, int k) {
+    int rc;
+    if (k < 0) {
+        rc = pthread_attr_setaffinity_np(attr, sizeof(gAllowedCpus), &gAllowedCpus);
+    } else {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(gCpus[k], &set);
+        rc = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    }
+    die_pthread(rc, "pthread_attr_setaffinity_np");
+    return attr;
+}
+
+// отказ всем поклонникам шарда (SIGINT)
+static void send_shard_abort_replies(Shard *sh) {
+    for (int k = 0; k < sh->count; ++k) {
+        sh->replies[k].accepted = 0;
+        sh->replies[k].winner_id = -1;
+        sh->replies[k].best_score = -1;
+        sh->replies[k].lts = log_stamp();
+        sh->replies[k].sent_ns = reply_stamp();
+    }
+    flag_publish_wake(&sh->reply_epoch);
+}
+
+// слияние локальных победителей (выполняет сервер, закончивший последним);
+// при равных score побеждает меньший id — как и в обычном режиме
+static void merge_shards(void) {
+    int best_id = -1;
+    int best_score = -1;
+    for (int s = 0; s < gServers; ++s) {
+        const Shard *sh = &gShards[s];
+        if (sh->best_id < 0) continue;
+        if (best_id < 0 || sh->best_score > best_score ||
+            (sh->best_score == best_score && sh->best_id < best_id)) {
+            best_score = sh->best_score;
+            best_id = sh->best_id;
+        }
+    }
+    atomic_store(&gWinnerId, best_id);
+    atomic_store(&gBestScore, best_score);
+}
+
+// поток сервера шарда: ждёт только своих поклонников по счётчику прибытия
+static void shard_run(Shard *sh) {
+    log_thread_init(LOG_SRC_SERVER + sh->id);
+
+    // ящики шарда выделяем и трогаем уже на своём ядре (first-touch → локальный узел)
+    size_t boxes = (size_t)(sh->count ? sh->count : 1);
+    sh->offers = (Offer*)malloc(boxes * sizeof(Offer));
+    sh->replies = (Reply*)malloc(boxes * sizeof(Reply));
+    int *cols = (int*)malloc(5 * boxes * sizeof(int));
+    if (!sh->offers || !sh->replies || !cols) die_errno("malloc(shard mailboxes)");
+    memset(sh->offers, 0, boxes * sizeof(Offer));
+    memset(sh->replies, 0, boxes * sizeof(Reply));
+    memset(cols, 0, 5 * boxes * sizeof(int));
+    cols_bind(&sh->cols, cols, (int)boxes);
+    atomic_fetch_add(&gShardsReady, 1);
+
+    LOG(LOG_SERVER, "[Сервер %d] Жду валентинки своего шарда (%d шт.)...\n", sh->id, sh->count);
+    perf_phase(PH_COLLECT);
+
+    for (int seen; (seen = poll_load(&sh->arrived)) < sh->count; ) {
+        if (poll_load(&gStop)) {
+            LOG(LOG_SERVER, "[Сервер %d] Получен SIGINT. Рассылаю отказ шарду и завершаю.\n", sh->id);
+            send_shard_abort_replies(sh);
+            return;
+        }
+        if (gWaitMode == WAITMODE_FUTEX) futex_wait_or_stop(&sh->arrived, seen, NULL);
+        else spin_yield();
+    }
+
+    poll_acquire();
+    perf_phase(PH_SELECT);
+
+    if (gOrderedLog) {
+        for (int k = 0; k < sh->count; ++k) log_recv(sh->offers[k].lts);
+    }
+
+    // локальный победитель: fans[] упорядочен по возрастанию id,
+    // поэтому первый ящик с максимальным рейтингом — и наименьший id
+    rate_offers(&sh->cols, sh->count);
+    int k_best = best_offer(&sh->cols, sh->count);
+    sh->best_id = (k_best >= 0) ? sh->fans[k_best] : -1;
+    sh->best_score = (k_best >= 0) ? sh->cols.rating[k_best] : -1;
+
+    if (sh->count > 0) {
+        LOG(LOG_SERVER, "[Сервер %d] Локальный победитель: клиент %02d, score=%d\n",
+                        sh->id, sh->best_id, sh->best_score);
+    }
+
+    // последний завершивший шард выполняет итоговое слияние
+    sh->lts = tClock;
+    if (counter_add(&gShardsDone, 1, memory_order_acq_rel) + 1 == gServers) {
+        for (int s = 0; s < gServers; ++s) log_recv(gShards[s].lts);
+        LOG(LOG_SERVER, "[Сервер %d] Все шарды готовы. Выбираю лучшее предложение...\n", sh->id);
+        merge_shards();
+
+        // имитация времени выбора (как в обычном режиме)
+        stop_wait_ms(gThinkUnitMs);
+
+        int win = atomic_load(&gWinnerId);
+        LOG(LOG_SERVER, "[Сервер %d] Выбрано предложение клиента %02d: score=%d, идея='%s'\n",
+                        sh->id, win, atomic_load(&gBestScore), offer_slot(win)->text);
+        gMergedLts = tClock;
+        flag_publish_wake(&gMerged);
+    } else {
+        while (!poll_load(&gMerged)) {
+            if (poll_load(&gStop)) {
+                LOG(LOG_SERVER, "[Сервер %d] SIGINT во время слияния. Рассылаю отказ шарду.\n", sh->id);
+                send_shard_abort_replies(sh);
+                return;
+            }
+            if (gWaitMode == WAITMODE_FUTEX) futex_wait_or_stop(&gMerged, 0, NULL);
+            else spin_yield();
+        }
+        poll_acquire();
+        log_recv(gMergedLts);
+    }
+
+    if (atomic_load(&gStop)) {
+        LOG(LOG_SERVER, "[Сервер %d] SIGINT во время выбора. Рассылаю отказ шарду.\n", sh->id);
+        send_shard_abort_replies(sh);
+        return;
+    }
+
+    // рассылка ответов своему шарду одной эпохой
+    perf_phase(PH_REPLY);
+    int best_id = atomic_load(&gWinnerId);
+    int best_score = atomic_load(&gBestScore);
+    for (int k = 0; k < sh->count; ++k) {
+        sh->replies[k].accepted = (sh->fans[k] == best_id) ? 1 : 0;
+        sh->replies[k].winner_id = best_id;
+        sh->replies[k].best_score = best_score;
+        sh->replies[k].lts = log_stamp();
+        sh->replies[k].sent_ns = reply_stamp();
+    }
+    flag_publish_wake(&sh->reply_epoch);
+
+    LOG(LOG_SERVER, "[Сервер %d] Ответы разосланы шарду. Завершаю работу.\n", sh->id);
+}
+
+static void *shard_thread(void *arg) {
+    perf_thread_begin(PERF_SERVER);
+    shard_run((Shard*)arg);
+    perf_thread_end();
+    return NULL;
+}
+
+// аргументы потока-запускальщика: создаёт поклонников first, first+step, ...
+typedef struct {
+    int first;
+    int step;
+    pthread_t *clients;
+    FanArgs *args;
+} LauncherArgs;
+
+static void *launcher_thread(void *arg) {
+    LauncherArgs *l = (LauncherArgs*)arg;
+    pthread_attr_t attr;
+    init_thread_attrs(&attr);
+    for (int i = l->first; i < gN; i += l->step) {
+        int rc = pthread_create(&l->clients[i], thread_attr(&attr, fan_cpu(i)), fan_thread, &l->args[i]);
+        die_pthread(rc, "pthread_create(client)");
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+// распределение поклонников по шардам (мультипликативный хеш id)
+static void setup_shards(void) {
+    gShards = (Shard*)aligned_alloc(64, sizeof(Shard) * (size_t)gServers);
+    gShardOf = (int*)calloc((size_t)gN, sizeof(int));
+    gSlotOf = (int*)calloc((size_t)gN, sizeof(int));
+    if (!gShards || !gShardOf || !gSlotOf) die_errno("alloc(shards)");
+    memset(gShards, 0, sizeof(Shard) * (size_t)gServers);
+
+    for (int i = 0; i < gN; ++i) {
+        gShardOf[i] = (int)(((unsigned)i * 2654435761u) % (unsigned)gServers);
+        gShards[gShardOf[i]].count++;
+    }
+
+    for (int s = 0; s < gServers; ++s) {
+        Shard *sh = &gShards[s];
+        sh->id = s;
+        sh->cpu = gServerCpu[s];
+        sh->best_id = -1;
+        sh->best_score = -1;
+        sh->fans = (int*)calloc((size_t)(sh->count ? sh->count : 1), sizeof(int));
+        if (!sh->fans) die_errno("calloc(shard fans)");
+        atomic_init(&sh->arrived, 0);
+        atomic_init(&sh->reply_epoch, 0);
+        sh->count = 0;
+    }
+    for (int i = 0; i < gN; ++i) {
+        Shard *sh = &gShards[gShardOf[i]];
+        gSlotOf[i] = sh->count;
+        sh->fans[sh->count++] = i;
+    }
+    atomic_init(&gShardsDone, 0);
+    atomic_init(&gShardsReady, 0);
+    atomic_init(&gMerged, 0);
+}
 
-        sched_yield();
+static void free_shards(void) {
+    if (!gShards) return;
+    for (int s = 0; s < gServers; ++s) {
+        free(gShards[s].fans);
+        free(gShards[s].offers);
+        free(gShards[s].replies);
+        free(gShards[s].cols.score);   // начало блока столбцов (cols_bind)
     }
+    free(gShards);
+    free(gShardOf);
+    free(gSlotOf);
+    gShards = NULL;
+    gShardOf = NULL;
+    gSlotOf = NULL;
+}
 
-    safe_print("[Сервер] Все валентинки получены. Выбираю лучшее предложение...\n");
+// секунды между двумя отметками CLOCK_MONOTONIC
+static double elapsed_sec(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
 
-    // выбираем предложение с максимальным score
-    int best_id = 0;
-    int best_score = gOffers[0].score;
-    for (int i = 1; i < gN; ++i) {
-        if (gOffers[i].score > best_score) {
-            best_score = gOffers[i].score;
-            best_id = i;
+// VSZ/RSS процесса из /proc/self/status в виде строки "vsz=... rss=... peak_rss=..."
+static void read_mem_usage(char *buf, size_t size) {
+    long vsz = -1, rss = -1, hwm = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            sscanf(line, "VmSize: %ld", &vsz);
+            sscanf(line, "VmRSS: %ld", &rss);
+            sscanf(line, "VmHWM: %ld", &hwm);
         }
+        fclose(f);
     }
+    snprintf(buf, size, "vsz=%ldKiB rss=%ldKiB peak_rss=%ldKiB", vsz, rss, hwm);
+}
 
-    // сохраняем итог для main
-    atomic_store(&gWinnerId, best_id);
-    atomic_store(&gBestScore, best_score);
+// сводка замеров (--bench): стена, CPU и переключения контекста всего процесса
+static void print_bench(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) die_errno("getrusage");
 
-    // имитация времени выбора
-    for (int s = 0; s < 1; ++s) {
-        if (atomic_load(&gStop)) {
-            safe_print("[Сервер] SIGINT во время выбора. Рассылаю отказ и завершаю.\n");
-            send_abort_replies();
-            return NULL;
-        }
-        sleep(1u);
+    static const char *pin_names[] = { "none", "cores", "numa" };
+    static const char *order_names[] = { "seqcst", "acqrel" };
+    fprintf(stderr, "[BENCH] N=%d servers=%d pin=%s cpus=%d nodes=%d order=%s\n",
+            gN, gServers, pin_names[gPinMode], gCpuCount, gNodeCount, order_names[gOrder]);
+    fprintf(stderr, "[BENCH] wall=%.3fs user=%.3fs sys=%.3fs nvcsw=%ld nivcsw=%ld\n",
+            elapsed_sec(&gBenchStart, &now),
+            (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6,
+            (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6,
+            ru.ru_nvcsw, ru.ru_nivcsw);
+    fprintf(stderr, "[BENCH] arena=%zuKiB huge_pages=%d minflt=%ld majflt=%ld\n",
+            gArena.size / 1024, gArena.huge, ru.ru_minflt, ru.ru_majflt);
+
+    char mem[128];
+    read_mem_usage(mem, sizeof(mem));
+    fprintf(stderr, "[BENCH] stack=%zuKiB mlock=%d at_launch: %s\n", gStackKb, gMlock, gMemAtPeak);
+    fprintf(stderr, "[BENCH] at_exit: %s\n", mem);
+}
+
+/*
+ * Замер ядра оценки (--rank-bench M) без потоков: M синтетических предложений,
+ * прежний выбор по одному столбцу score против rate_offers + best_offer.
+ * Лучшее время из нескольких повторов, в нс на предложение.
+ */
+static void run_rank_bench(int m) {
+    int *mem = (int*)malloc(5 * (size_t)m * sizeof(int));
+    if (!mem) die_errno("malloc(rank-bench)");
+    OfferCols c;
+    cols_bind(&c, mem, m);
+
+    Xoshiro256 x;
+    xoshiro_seed(&x, 42);
+    for (int k = 0; k < m; ++k) {
+        c.score[k] = xoshiro_between(&x, SCORE_MIN, SCORE_MAX);
+        c.cost[k] = xoshiro_between(&x, 1, 100);
+        c.duration[k] = xoshiro_between(&x, 1, 6);
+        c.idea[k] = xoshiro_between(&x, 0, IDEAS_COUNT - 1);
     }
 
-    safe_print("[Сервер] Выбрано предложение клиента %02d: score=%d, идея='%s'\n",
-               best_id, best_score, gOffers[best_id].text);
+    enum { REPS = 20 };
+    double best_single = 1e9, best_multi = 1e9;
+    volatile int sink = 0;
+    for (int rep = 0; rep < REPS; ++rep) {
+        struct timespec t0, t1, t2;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int id = 0;
+        for (int k = 1; k < m; ++k) {
+            if (c.score[k] > c.score[id]) id = k;
+        }
+        sink = id;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        rate_offers(&c, m);
+        sink = best_offer(&c, m);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
 
-    // рассылка ответов всем клиентам
-    for (int i = 0; i < gN; ++i) {
-        gReplies[i].accepted = (i == best_id) ? 1 : 0;
-        gReplies[i].winner_id = best_id;
-        gReplies[i].best_score = best_score;
-        atomic_store(&gReplied[i], 1);
+        double single = elapsed_sec(&t0, &t1), multi = elapsed_sec(&t1, &t2);
+        if (single < best_single) best_single = single;
+        if (multi < best_multi) best_multi = multi;
     }
+    (void)sink;
 
-    safe_print("[Сервер] Ответы разосланы всем. Завершаю работу.\n");
-    return NULL;
+    fprintf(stderr, "[BENCH] rank: offers=%d weights=%d/%d/%d/%d fav=%d\n", m,
+            gWeights.score, gWeights.cost, gWeights.duration, gWeights.idea, gWeights.fav_idea);
+    fprintf(stderr, "[BENCH] rank: single_int=%.3fns/offer weighted=%.3fns/offer ratio=%.2f\n",
+            best_single * 1e9 / m, best_multi * 1e9 / m, best_multi / best_single);
+    free(mem);
 }
 
 // безопасный парс int (проверка хвоста строки, диапазона)
@@ -282,36 +3205,335 @@ static int parse_uint(const char *s, unsigned *out) {
     return 1;
 }
 
-// простая "конфигурация": строки вида N=10, SEED=12345
-// считываем построчно и обновляем параметры, если нашли подходящую строку
-static void read_config(const char *fname, int *outN, unsigned *outSeed) {
-    FILE *f = fopen(fname, "r");
-    if (!f) die_errno("fopen(config)");
+/*
+ * Дифференциальная проверка (--check): одни и те же сценарии (N, SEED) по сетке
+ * играются во всех режимах оптимизации, и ответ каждому поклоннику (принят ли,
+ * победитель, best_score, опоздание) сравнивается с базовым режимом. Время
+ * обдумывания и выбора в проверке нулевое (--think-unit 0), лог выключен.
+ * Таблица — в stdout: строка на ячейку (сценарий, режим) с итогом, дайджестом
+ * ответов (FNV-1a, тот же, что печатает --check версии 9-10) и временем.
+ * Расхождение с базой — код выхода 3, как дрейф кэша.
+ */
+#define CHECK_MAX_N 1000
+#define CHECK_SEEDS 3                // SEED, SEED+1, SEED+2
 
-    char line[256];
-    while (fgets(line, sizeof(line), f)) {
-        // убираем перевод строки
-        size_t len = strlen(line);
-        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
-            line[--len] = '\0';
+typedef struct {
+    int32_t accepted, late, winner_id, best_score;
+} CheckReply;
+
+typedef struct {
+    const char *name;
+    int wait, wake_chain, order, queue, tree, servers, launchers;
+} CheckMode;
+
+static const CheckMode kCheckModes[] = {
+    { "base",       WAITMODE_SPIN,  0, ORDER_SEQ_CST, 0, 0, 1, 0 },
+    { "futex",      WAITMODE_FUTEX, 0, ORDER_SEQ_CST, 0, 0, 1, 0 },
+    { "wake-chain", WAITMODE_FUTEX, 4, ORDER_SEQ_CST, 0, 0, 1, 0 },
+    { "acqrel",     WAITMODE_SPIN,  0, ORDER_ACQ_REL, 0, 0, 1, 0 },
+    { "queue",      WAITMODE_SPIN,  0, ORDER_SEQ_CST, 1, 0, 1, 0 },
+    { "tree",       WAITMODE_SPIN,  0, ORDER_SEQ_CST, 0, 4, 1, 0 },
+    { "servers",    WAITMODE_FUTEX, 0, ORDER_SEQ_CST, 0, 0, 4, 0 },
+    { "launchers",  WAITMODE_SPIN,  0, ORDER_SEQ_CST, 0, 0, 1, 4 },
+};
+
+static int gCheck = 0;
+static int gCheckWinner, gCheckBest;
+static CheckReply gCheckGot[CHECK_MAX_N];
+
+// ответы сыгранного раунда (до освобождения ящиков шардов)
+static void check_capture(int win, int best) {
+    gCheckWinner = win;
+    gCheckBest = best;
+    for (int i = 0; i < gN; ++i) {
+        const Reply *r = reply_slot(i);
+        gCheckGot[i] = (CheckReply){ r->accepted, r->late, r->winner_id, r->best_score };
+    }
+}
+
+static void check_apply(const CheckMode *m) {
+    gWaitMode = m->wait;
+    gWakeChain = m->wake_chain;
+    gOrder = m->order;
+    gQueueMode = m->queue;
+    gTreeFanin = m->tree;
+    gLaunchers = m->launchers;
+    if (gServers != m->servers) {
+        gServers = m->servers;
+        memset(gCpuReserved, 0, (size_t)gCpuCount);
+        plan_servers(gServers);
+    }
+}
+
+static void run_round(int round, unsigned seed);
+
+// n < 0 — вся сетка N; 0 — расхождений нет
+static int run_check(int n, unsigned seed) {
+    static const int grid[] = { 1, 2, 5, 30, 100, 1000 };
+    static CheckReply want[CHECK_MAX_N];
+    int ncount = n < 0 ? (int)(sizeof(grid) / sizeof(grid[0])) : 1;
+    int modes = (int)(sizeof(kCheckModes) / sizeof(kCheckModes[0]));
+    int cells = 0, diffs = 0;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    safe_print("# N\tSEED\tmode\twinner\tbest_score\tdigest\twall_ms\tstatus\n");
+    for (int a = 0; a < ncount && !atomic_load(&gStop); ++a) {
+        gN = n < 0 ? grid[a] : n;
+        atomic_store_explicit(&gStatsN, gN, memory_order_relaxed);
+        for (unsigned k = 0; k < CHECK_SEEDS && !atomic_load(&gStop); ++k) {
+            int want_win = -1, want_best = -1;
+            for (int m = 0; m < modes && !atomic_load(&gStop); ++m) {
+                const CheckMode *cm = &kCheckModes[m];
+                if (cm->servers > gN) continue;
+                check_apply(cm);
+
+                struct timespec r0, r1;
+                clock_gettime(CLOCK_MONOTONIC, &r0);
+                run_round(1, seed + k);
+                clock_gettime(CLOCK_MONOTONIC, &r1);
+                if (atomic_load(&gStop)) break;
+
+                uint64_t digest = fnv1a(14695981039346656037ull, gCheckGot, (size_t)gN * sizeof(CheckReply));
+                char status[32] = "golden";
+                if (m == 0) {
+                    memcpy(want, gCheckGot, (size_t)gN * sizeof(CheckReply));
+                    want_win = gCheckWinner;
+                    want_best = gCheckBest;
+                } else {
+                    int differ = 0;
+                    for (int i = 0; i < gN; ++i) differ += memcmp(&want[i], &gCheckGot[i], sizeof(CheckReply)) != 0;
+                    if (differ || gCheckWinner != want_win || gCheckBest != want_best) {
+                        snprintf(status, sizeof(status), "DIFF(%d fans)", differ);
+                        ++diffs;
+                        fprintf(stderr, "[CHECK] mismatch: N=%d SEED=%u mode=%s: winner=%d best_score=%d, "
+                                        "base winner=%d best_score=%d, %d replies differ\n",
+                                gN, seed + k, cm->name, gCheckWinner, gCheckBest,
+                                want_win, want_best, differ);
+                    } else {
+                        snprintf(status, sizeof(status), "ok");
+                    }
+                }
+                safe_print("%d\t%u\t%s\t%d\t%d\t%016llx\t%.3f\t%s\n", gN, seed + k, cm->name,
+                           gCheckWinner, gCheckBest, (unsigned long long)digest,
+                           elapsed_sec(&r0, &r1) * 1e3, status);
+                ++cells;
+            }
         }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_flush();   // таблица — раньше итоговой строки
+    fprintf(stderr, "[CHECK] cells=%d modes=%d mismatches=%d wall=%.3fs%s\n", cells, modes, diffs,
+            elapsed_sec(&t0, &t1), atomic_load(&gStop) ? " interrupted by SIGINT" : "");
+    return diffs;
+}
 
-        int n_tmp = 0;
-        unsigned s_tmp = 0;
+/*
+ * Один раунд: раскладка состояния в арене, генерация параметров, запуск сервера
+ * (или шардов) и N поклонников, ожидание и итог. Между раундами арена не
+ * переотображается, пока новое N в неё помещается: reset лишь обнуляет занятую часть.
+ */
+static void run_round(int round, unsigned seed) {
+    int rc;
 
-        if (sscanf(line, "N=%d", &n_tmp) == 1) {
-            *outN = n_tmp;
-            continue;
+    // сценарий уже в кэше: итог без запуска потоков (если он не выбран для сверки)
+    CacheEntry cached;
+    int have_cached = cache_usable() && cache_lookup(gN, seed, &cached);
+    if (have_cached && !cache_pick_verify(&cached)) {
+        fprintf(stderr, "[CACHE] hit: engine=%s N=%d SEED=%u\n", CACHE_ENGINE, gN, seed);
+        if (gRounds != 1) LOG(LOG_MAIN, "[MAIN] Раунд %d: N=%d, SEED=%u — итог из кэша\n", round, gN, seed);
+        LOG(LOG_MAIN, "[MAIN] Итог: победил клиент %02d, best_score=%d\n", cached.winner_id, cached.best_score);
+        log_flush();
+        stat_inc(&gStats.rounds);
+        return;
+    }
+
+    // выделяем общую память под предложения/ответы/флаги
+    // (одно отображение на все массивы прогона — см. Arena)
+    RunState st;
+    size_t need = run_state_size(gN);
+    if (!gArena.base || need > gArena.size) {
+        arena_free(&gArena);
+        arena_init(&gArena, need);
+        LOG(LOG_DEBUG, "[MAIN] Арена: %u КиБ (%s)\n", (unsigned)(gArena.size >> 10),
+                       gArena.huge ? "huge pages" : "обычные страницы");
+    } else {
+        arena_reset(&gArena);
+        LOG(LOG_DEBUG, "[MAIN] Арена переиспользована: %u КиБ\n", (unsigned)(gArena.size >> 10));
+    }
+    run_state_alloc(&gArena, &st, gN);
+    gOffers = st.offers;
+    gReplies = st.replies;
+    gSubmitted = st.submitted;
+    gReplied = st.replied;
+
+    // случайные параметры всех поклонников — одним пакетом до запуска потоков
+    gParams.think = st.think;
+    gParams.score = st.score;
+    gParams.idea = st.idea;
+    gParams.cost = st.cost;
+    gParams.duration = st.duration;
+    cols_bind(&gCols, st.cols, gN);
+    if (gQueueMode) queue_init(&gQueue, st.queue, gN);
+    struct timespec gen_start, gen_end;
+    clock_gettime(CLOCK_MONOTONIC, &gen_start);
+    gen_fan_params(seed, 0, gN);
+    clock_gettime(CLOCK_MONOTONIC, &gen_end);
+    gGenMs += elapsed_sec(&gen_start, &gen_end) * 1e3;
+
+    // инициализация атомарных флагов и итогов прошлого раунда
+    for (int i = 0; i < gN; ++i) {
+        atomic_init(&gSubmitted[i], 0);
+        atomic_init(&gReplied[i], 0);
+    }
+    atomic_store(&gWinnerId, -1);
+    atomic_store(&gBestScore, -1);
+    atomic_store(&gEarlyId, -1);
+    atomic_store(&gArrivals, 0);
+    atomic_store(&gRunning, 0);
+    gGateOpen = 0;
+    gLateCount = 0;
+    gClosedBy = 0;
+    if (gEarly) {
+        // счётчик eventfd не сбросить без чтения — проще завести новый
+        if (gReleaseFd >= 0) close(gReleaseFd);
+        gReleaseFd = eventfd(0, EFD_CLOEXEC);
+        if (gReleaseFd < 0) die_errno("eventfd(release)");
+    }
+
+    rec_begin_round();
+    replay_begin_round(round, seed);
+
+    if (gRounds == 1) {
+        LOG(LOG_MAIN, "[MAIN] Старт: N=%d, SEED=%u (Ctrl+C для прерывания)\n", gN, seed);
+    } else {
+        LOG(LOG_MAIN, "[MAIN] Раунд %d: N=%d, SEED=%u (Ctrl+C для прерывания)\n", round, gN, seed);
+    }
+    gSpawnClock = tClock;
+
+    // создаём поток сервера (студентка) или S серверов шардов
+    // (серверы шардов всегда закреплены за своими ядрами, обычный сервер — только с --pin)
+    pthread_t server;
+    pthread_t *shard_servers = NULL;
+    if (gServers > 1) {
+        setup_shards();
+        LOG(LOG_MAIN, "[MAIN] Шардированный режим: %d серверов\n", gServers);
+        shard_servers = (pthread_t*)calloc((size_t)gServers, sizeof(pthread_t));
+        if (!shard_servers) die_errno("calloc(shard_servers)");
+        for (int s = 0; s < gServers; ++s) {
+            rc = pthread_create(&shard_servers[s], thread_attr(&gThreadAttr, gShards[s].cpu), shard_thread, &gShards[s]);
+            die_pthread(rc, "pthread_create(shard)");
         }
-        if (sscanf(line, "SEED=%u", &s_tmp) == 1) {
-            *outSeed = s_tmp;
-            continue;
+        // поклонников запускаем только после того, как шарды разместили свои ящики
+        while (atomic_load(&gShardsReady) < gServers) spin_yield();
+    } else {
+        if (gTreeFanin) setup_tree();
+        rc = pthread_create(&server, thread_attr(&gThreadAttr, gPinMode != PIN_NONE ? gServerCpu[0] : -1),
+                            girl_thread, NULL);
+        die_pthread(rc, "pthread_create(server)");
+    }
+
+    // создаём N потоков клиентов (поклонники)
+    pthread_t *clients = st.clients;
+    FanArgs *args = st.args;
+
+    for (int i = 0; i < gN; ++i) {
+        args[i].fan_id = i;
+    }
+
+    struct timespec launch_start;
+    clock_gettime(CLOCK_MONOTONIC, &launch_start);
+    if (gLaunchers > 0) {
+        // параллельный запуск: L запускальщиков, поклонники стартуют через шлюз
+        pthread_t launchers[MAX_LAUNCHERS];
+        LauncherArgs largs[MAX_LAUNCHERS];
+        for (int l = 0; l < gLaunchers; ++l) {
+            largs[l] = (LauncherArgs){ l, gLaunchers, clients, args };
+            rc = pthread_create(&launchers[l], thread_attr(&gThreadAttr, -1), launcher_thread, &largs[l]);
+            die_pthread(rc, "pthread_create(launcher)");
+        }
+        for (int l = 0; l < gLaunchers; ++l) {
+            rc = pthread_join(launchers[l], NULL);
+            die_pthread(rc, "pthread_join(launcher)");
+        }
+    } else {
+        for (int i = 0; i < gN; ++i) {
+            rc = pthread_create(&clients[i], thread_attr(&gThreadAttr, fan_cpu(i)), fan_thread, &args[i]);
+            die_pthread(rc, "pthread_create(client)");
         }
     }
 
-    fclose(f);
-}
+    // все потоки запущены и ещё "думают" — это пик по виртуальной памяти
+    if (gBench) {
+        read_mem_usage(gMemAtPeak, sizeof(gMemAtPeak));
+        while (atomic_load(&gRunning) < gN) spin_yield();
+        fprintf(stderr, "[BENCH] startup: launchers=%d time_to_all_running=%.3fms\n",
+                gLaunchers, elapsed_sec(&launch_start, &gAllRunningAt) * 1e3);
+    }
+
+    // ждём завершения всех клиентов
+    for (int i = 0; i < gN; ++i) {
+        rc = pthread_join(clients[i], NULL);
+        die_pthread(rc, "pthread_join(client)");
+    }
+
+    // ждём завершения сервера (или всех серверов шардов)
+    if (shard_servers) {
+        for (int s = 0; s < gServers; ++s) {
+            rc = pthread_join(shard_servers[s], NULL);
+            die_pthread(rc, "pthread_join(shard)");
+        }
+    } else {
+        rc = pthread_join(server, NULL);
+        die_pthread(rc, "pthread_join(server)");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &gJoinedAt);
+    unsigned long long last = atomic_exchange(&gFanoutLastNs, 0);
+    if (gBench && last > gFanoutStartNs && gFanoutStartNs) {
+        gFanoutNsSum += last - gFanoutStartNs;
+        ++gFanoutRounds;
+    }
+    gFanoutStartNs = 0;
+    rec_flush_round(round, seed);
 
+    // печать итогов (в упорядоченном логе — после всех строк потоков)
+    if (gOrderedLog) log_join_all();
+    int win = atomic_load(&gWinnerId);
+    int best = atomic_load(&gBestScore);
+
+    if (atomic_load(&gStop)) {
+        LOG(LOG_MAIN, "[MAIN] Завершение по SIGINT.\n");
+    } else {
+        if (win >= 0) {
+            LOG(LOG_MAIN, "[MAIN] Итог: победил клиент %02d, best_score=%d\n", win, best);
+        } else {
+            LOG(LOG_MAIN, "[MAIN] Итог: к дедлайну не успел никто\n");
+        }
+        if (gClosedBy == LATE_EARLY) {
+            LOG(LOG_MAIN, "[MAIN] Досрочное решение (score=%d): не дождались %d из %d\n", SCORE_MAX, gLateCount, gN);
+        } else if (gDeadlineMs) {
+            LOG(LOG_MAIN, "[MAIN] Дедлайн %d мс: не успели %d из %d\n", gDeadlineMs, gLateCount, gN);
+        }
+    }
+    log_flush();
+    stat_inc(&gStats.rounds);
+
+    // сыгранный раунд — в кэш, а выбранный для сверки — сравнить с записью
+    if (cache_usable() && !atomic_load(&gStop)) {
+        CacheEntry got = { .cfg = cache_cfg_hash(), .n = gN, .seed = seed, .winner_id = win, .best_score = best };
+        snprintf(got.engine, sizeof(got.engine), "%s", CACHE_ENGINE);
+        for (int i = 0; i < gN; ++i) got.accepted[i] = (uint8_t)reply_slot(i)->accepted;
+        if (have_cached) cache_verify(&cached, &got);
+        else cache_store(&got);
+    }
+    if (gCheck) check_capture(win, best);
+
+    // структуры режимов строятся заново под N следующего раунда
+    free(shard_servers);
+    free_shards();
+    free(gTree);
+    gTree = NULL;
+}
 
 int main(int argc, char **argv) {
     /*
@@ -323,9 +3545,12 @@ int main(int argc, char **argv) {
      */
     int n_from_cli = -1;
     unsigned seed_from_cli = (unsigned)time(NULL);
+    int log_from_cli = LOG_FANS;
+    int seed_set = 0;             // -s задан явно (для --check: иначе SEED = 1)
 
     const char *out_name = NULL; // имя лог-файла (если нужно)
     const char *cfg_name = NULL; // имя конфиг-файла (если нужно)
+    const char *record_name = NULL; // файл записи событий (--record)
 
     // разбор ключей командной строки
     for (int i = 1; i < argc; ++i) {
@@ -345,6 +3570,7 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "Missing value for -s\n");
                 return 1;
             }
+            seed_set = 1;
             if (!parse_uint(argv[++i], &seed_from_cli)) {
                 fprintf(stderr, "Invalid value for -s\n");
                 return 1;
@@ -363,6 +3589,257 @@ int main(int argc, char **argv) {
                 return 1;
             }
             cfg_name = argv[++i];
+        } else if (!strcmp(argv[i], "--servers")) {
+            // число серверов (шардированный режим)
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --servers\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gServers) || gServers < 1 || gServers > MAX_SERVERS) {
+                fprintf(stderr, "Invalid value for --servers (1..%d)\n", MAX_SERVERS);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--tree")) {
+            // комбинирующее дерево прибытия с заданной арностью
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --tree\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gTreeFanin) ||
+                gTreeFanin < TREE_MIN_FANIN || gTreeFanin > TREE_MAX_FANIN) {
+                fprintf(stderr, "Invalid value for --tree (%d..%d)\n", TREE_MIN_FANIN, TREE_MAX_FANIN);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--pin")) {
+            // привязка потоков к ядрам
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --pin\n");
+                return 1;
+            }
+            ++i;
+            if (!strcmp(argv[i], "none")) gPinMode = PIN_NONE;
+            else if (!strcmp(argv[i], "cores")) gPinMode = PIN_CORES;
+            else if (!strcmp(argv[i], "numa")) gPinMode = PIN_NUMA;
+            else {
+                fprintf(stderr, "Invalid value for --pin (none|cores|numa)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--stack") || !strcmp(argv[i], "--guard")) {
+            // размер стека / защитной зоны потоков в КиБ
+            const char *opt = argv[i];
+            int kb = 0;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for %s\n", opt);
+                return 1;
+            }
+            if (!parse_int(argv[++i], &kb) || kb < 0 || kb > 1024 * 1024) {
+                fprintf(stderr, "Invalid value for %s\n", opt);
+                return 1;
+            }
+            if (!strcmp(opt, "--stack")) {
+                if (kb > 0 && (size_t)kb * 1024 < (size_t)PTHREAD_STACK_MIN) {
+                    fprintf(stderr, "--stack must be 0 or at least %zu KiB\n",
+                            (size_t)PTHREAD_STACK_MIN / 1024);
+                    return 1;
+                }
+                gStackKb = (size_t)kb;
+            } else {
+                gGuardKb = (size_t)kb;
+            }
+        } else if (!strcmp(argv[i], "--mlock")) {
+            // закрепить память процесса (включая стеки потоков) в RAM
+            gMlock = 1;
+        } else if (!strcmp(argv[i], "--launchers")) {
+            // параллельный запуск поклонников со стартовым шлюзом
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --launchers\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gLaunchers) || gLaunchers < 1 || gLaunchers > MAX_LAUNCHERS) {
+                fprintf(stderr, "Invalid value for --launchers (1..%d)\n", MAX_LAUNCHERS);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--rng")) {
+            // генератор случайных чисел
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --rng\n");
+                return 1;
+            }
+            ++i;
+            if (!strcmp(argv[i], "rand_r")) gRng = RNG_RAND_R;
+            else if (!strcmp(argv[i], "xoshiro")) gRng = RNG_XOSHIRO;
+            else if (!strcmp(argv[i], "pcg")) gRng = RNG_PCG;
+            else {
+                fprintf(stderr, "Invalid value for --rng (rand_r|xoshiro|pcg)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--order")) {
+            // профиль упорядочивания памяти для флагов протокола
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --order\n");
+                return 1;
+            }
+            ++i;
+            if (!strcmp(argv[i], "seqcst")) gOrder = ORDER_SEQ_CST;
+            else if (!strcmp(argv[i], "acqrel")) gOrder = ORDER_ACQ_REL;
+            else {
+                fprintf(stderr, "Invalid value for --order (seqcst|acqrel)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--early")) {
+            // досрочное решение при максимальном score
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --early\n");
+                return 1;
+            }
+            ++i;
+            if (!strcmp(argv[i], "first")) gEarly = EARLY_FIRST;
+            else if (!strcmp(argv[i], "lowest")) gEarly = EARLY_LOWEST;
+            else {
+                fprintf(stderr, "Invalid value for --early (first|lowest)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--deadline")) {
+            // дедлайн сбора предложений в мс
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --deadline\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gDeadlineMs) || gDeadlineMs < 1) {
+                fprintf(stderr, "Invalid value for --deadline (ms > 0)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--rank-bench")) {
+            // замер ядра оценки на M синтетических предложениях
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --rank-bench\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gRankBench) || gRankBench < 1 || gRankBench > 100000000) {
+                fprintf(stderr, "Invalid value for --rank-bench (1..100000000)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--ordered-log")) {
+            // строки в буферы потоков, при выходе — слияние по логическому времени
+            gOrderedLog = 1;
+        } else if (!strcmp(argv[i], "--stats")) {
+            // сводка счётчиков в stderr при выходе
+            gStatsSummary = 1;
+        } else if (!strcmp(argv[i], "--metrics")) {
+            // файл метрик в формате Prometheus (снимки по SIGUSR1 и при выходе)
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --metrics\n");
+                return 1;
+            }
+            gMetricsPath = argv[++i];
+        } else if (!strcmp(argv[i], "--rounds")) {
+            // несколько раундов подряд (0 = до SIGINT), конфиг -c перечитывается между ними
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --rounds\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gRounds) || gRounds < 0) {
+                fprintf(stderr, "Invalid value for --rounds (0 = until SIGINT)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--wait")) {
+            // как поклонник ждёт ответа: опросом или сном на futex
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --wait\n");
+                return 1;
+            }
+            ++i;
+            if (!strcmp(argv[i], "spin")) gWaitMode = WAITMODE_SPIN;
+            else if (!strcmp(argv[i], "futex")) gWaitMode = WAITMODE_FUTEX;
+            else {
+                fprintf(stderr, "Invalid value for --wait (spin|futex)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--wake-chain")) {
+            // ответы будят поклонники друг друга по K-арному дереву, а не сервер подряд
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --wake-chain\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gWakeChain) || gWakeChain < 1 || gWakeChain > WAKE_CHAIN_MAX) {
+                fprintf(stderr, "Invalid value for --wake-chain (1..%d)\n", WAKE_CHAIN_MAX);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--cache")) {
+            // файл кэша результатов: сыгранные сценарии не играются повторно
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --cache\n");
+                return 1;
+            }
+            gCachePath = argv[++i];
+        } else if (!strcmp(argv[i], "--cache-verify")) {
+            // каждый K-й найденный в кэше сценарий переигрывается и сверяется
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --cache-verify\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gCacheVerify) || gCacheVerify < 1) {
+                fprintf(stderr, "Invalid value for --cache-verify (K >= 1)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--think-unit")) {
+            // длина "секунды" обдумывания и выбора в мс (протокол тот же, только быстрее)
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --think-unit\n");
+                return 1;
+            }
+            if (!parse_int(argv[++i], &gThinkUnitMs) || gThinkUnitMs < 0 || gThinkUnitMs > 1000) {
+                fprintf(stderr, "Invalid value for --think-unit (0..1000)\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--record")) {
+            // порядок событий протокола каждого раунда — в файл
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --record\n");
+                return 1;
+            }
+            record_name = argv[++i];
+        } else if (!strcmp(argv[i], "--replay")) {
+            // повторить записанный порядок отправок и прочтения ответов
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --replay\n");
+                return 1;
+            }
+            gReplayPath = argv[++i];
+        } else if (!strcmp(argv[i], "--check")) {
+            // сверка итогов всех режимов оптимизации на сетке N и фиксированных SEED
+            gCheck = 1;
+        } else if (!strcmp(argv[i], "--quiet")) {
+            // без протокола раунда: остаются только отчёты в stderr
+            log_from_cli = LOG_QUIET;
+        } else if (!strcmp(argv[i], "--log")) {
+            // уровень лога (LOG_LEVEL= в конфиге, если задан, важнее)
+            static const char *const names[] = { "quiet", "summary", "server", "event", "debug" };
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for --log\n");
+                return 1;
+            }
+            ++i;
+            log_from_cli = LOG_QUIET - 1;
+            for (int l = LOG_QUIET; l <= LOG_DEBUG; ++l) {
+                if (!strcmp(argv[i], names[l - LOG_QUIET])) log_from_cli = l;
+            }
+            if (log_from_cli < LOG_QUIET) {
+                fprintf(stderr, "Invalid value for --log (quiet|summary|server|event|debug)\n");
+                return 1;
+            }
+            if (log_from_cli > LOG_MAX_LEVEL) {
+                fprintf(stderr, "[LOG] level %s is compiled out (LOG_MAX_LEVEL=%d)\n", argv[i], LOG_MAX_LEVEL);
+            }
+        } else if (!strcmp(argv[i], "--queue")) {
+            // предложения через MPSC-очередь: сервер разбирает их по мере прибытия
+            gQueueMode = 1;
+        } else if (!strcmp(argv[i], "--perf")) {
+            // аппаратные счётчики по фазам протокола, отчёт в stderr при выходе
+            gPerf = 1;
+        } else if (!strcmp(argv[i], "--bench")) {
+            // сводка замеров в stderr при выходе
+            gBench = 1;
         } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
             // справка
             fprintf(stderr,
@@ -373,8 +3850,58 @@ int main(int argc, char **argv) {
                     "  -n N      number of fans (1..1000)\n"
                     "  -s SEED   optional seed\n"
                     "  -c FILE   read N and SEED from config file (N=..., SEED=...)\n"
-                    "  -o FILE   write log to file (in addition to console)\n",
-                    argv[0], argv[0]);
+                    "  -o FILE   write log to file (in addition to console)\n"
+                    "  --servers S  partition fans across S server threads (1..%d)\n"
+                    "  --tree K     combining-tree arrival with fan-in K (%d..%d)\n"
+                    "  --pin MODE   thread placement: none, cores, numa (default none)\n"
+                    "  --stack KB   thread stack size in KiB (default %d, 0 = system default)\n"
+                    "  --guard KB   thread guard size in KiB (default: system)\n"
+                    "  --mlock      lock process memory with mlockall\n"
+                    "  --launchers L  spawn fans from L launcher threads behind a start gate (1..%d)\n"
+                    "  --rng NAME   random generator: rand_r (default, reproduces old SEED runs), xoshiro, pcg\n"
+                    "  --order MODE memory ordering for protocol flags: seqcst (default), acqrel\n"
+                    "  --deadline MS  choose among offers received within MS ms, late fans get \"too late\"\n"
+                    "  --early MODE decide as soon as score %d arrives: first (first arrival wins), lowest (lowest id wins)\n"
+                    "  --cache FILE result cache (memory-mapped, shared with 9-10): a scenario already played with\n"
+                    "               the same N, SEED, generator and weights prints its result without running\n"
+                    "               (not used with --deadline/--early, whose result depends on timing)\n"
+                    "  --cache-verify K  replay every K-th cached scenario and compare (drift: exit code 3)\n"
+                    "  --queue      fans push offers into a lock-free MPSC queue that the server drains\n"
+                    "               while others are still thinking (arrival-order log, running stats)\n"
+                    "  --wait MODE  how fans wait for the reply: spin (default, poll with sched_yield), futex\n"
+                    "               (sleep on the reply word and the stop word at once with futex_waitv)\n"
+                    "  --wake-chain K  with --wait futex: the server wakes fans 0..K-1 only, and every woken fan\n"
+                    "               wakes its K children before reading its reply (1..%d)\n"
+                    "  --rounds R   play R rounds in a row (default 1, 0 = until SIGINT), SEED + r - 1 in round r;\n"
+                    "               with -c the config is watched and a saved change applies from the next round\n"
+                    "  --log LEVEL  log verbosity: quiet, summary (main only), server (+ servers),\n"
+                    "               event (+ fans, default), debug (+ wait loop and arena details);\n"
+                    "               levels above LOG_MAX_LEVEL (build flag, default 3) are compiled out\n"
+                    "  --quiet      same as --log quiet: no round log, stderr reports only\n"
+                    "  --think-unit MS  length of one second of thinking and choosing, in ms (default 1000)\n"
+                    "  --record FILE  write protocol events of every round (submit, collect, reply, wake) with\n"
+                    "               time since round start and kernel thread id to FILE\n"
+                    "  --replay FILE  force the recorded submission order and reply-read order (same N and SEED;\n"
+                    "               not with --deadline, --early, --servers, --wake-chain)\n"
+                    "  --check      play fixed scenarios (N in 1,2,5,30,100,1000 or -n N; SEED..SEED+2, default\n"
+                    "               SEED 1) in every optimization mode, compare each fan's reply with the base\n"
+                    "               mode, print a table with a reply digest and wall time (mismatch: exit code 3)\n"
+                    "  --bench      print timing summary to stderr at exit\n"
+                    "  --perf       count cycles, instructions, L1D/LLC misses and context switches per\n"
+                    "               protocol phase (perf_event_open) and print them at exit\n"
+                    "  --ordered-log  buffer log lines per thread and print them at exit merged by\n"
+                    "                 (logical timestamp, source): identical logs for a given SEED\n"
+                    "  --stats      print runtime counters to stderr at exit\n"
+                    "  --metrics FILE  write counters in Prometheus text format on SIGUSR1 and at exit\n"
+                    "                  (without --metrics, SIGUSR1 prints a snapshot to stderr)\n"
+                    "  --rank-bench M  time the weighted scoring kernel on M synthetic offers and exit\n"
+                    "\n"
+                    "  Config weights (-c): W_SCORE=, W_COST=, W_DURATION=, W_IDEA= (|w| <= %d), FAV_IDEA= (0..%d);\n"
+                    "  offers are ranked by the weighted sum, default W_SCORE=1 and the rest 0\n"
+                    "  Other config keys: THINK_MIN=, THINK_MAX= (seconds, default 1..3, max %d), DEADLINE_MS= (0 = off),\n"
+                    "  LOG_LEVEL= (-1 = quiet, 0 = main only, 1 = + servers, 2 = + fans, default, 3 = + debug)\n",
+                    argv[0], argv[0], MAX_SERVERS, TREE_MIN_FANIN, TREE_MAX_FANIN, DEFAULT_STACK_KB, MAX_LAUNCHERS, SCORE_MAX,
+                    WAKE_CHAIN_MAX, WEIGHT_LIMIT, IDEAS_COUNT - 1, THINK_LIMIT);
             return 0;
         } else {
             fprintf(stderr, "Unknown argument: %s\n", argv[i]);
@@ -383,102 +3910,210 @@ int main(int argc, char **argv) {
         }
     }
 
+    // в проверке сетка N своя (-n сужает её до одного N), SEED по умолчанию фиксирован
+    int check_n = n_from_cli;
+    if (gCheck && n_from_cli < 0 && !cfg_name) n_from_cli = 1;
+    if (gCheck && !seed_set) seed_from_cli = 1;
+
     // параметры по умолчанию
-    int n = n_from_cli;
-    unsigned base_seed = seed_from_cli;
+    gBaseCfg = (Config){ n_from_cli, seed_from_cli, gThinkMin, gThinkMax, gDeadlineMs, log_from_cli, gWeights };
+    Config cfg = gBaseCfg;
 
     // если указан конфиг — берём параметры из файла
     // (при этом ключи -n/-s считаются неактуальными)
     if (cfg_name) {
-        read_config(cfg_name, &n, &base_seed);
+        if (!read_config(cfg_name, &cfg)) die_errno("fopen(config)");
+        gCfgPath = cfg_name;
     }
 
-    // проверка диапазона
-    if (n < 1 || n > 1000) {
-        fprintf(stderr, "N must be in [1..1000]\n");
+    char err[128];
+    if (!config_check(&cfg, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
         return 1;
     }
+    apply_config(&cfg);
+    unsigned seed = cfg.seed;
+
+    if (gRankBench) {
+        run_rank_bench(gRankBench);
+        return 0;
+    }
 
-    gN = n;
+    if (gTreeFanin && gServers > 1) {
+        fprintf(stderr, "--tree cannot be combined with --servers\n");
+        return 1;
+    }
+    if (gEarly && (gTreeFanin || gServers > 1)) {
+        fprintf(stderr, "--early cannot be combined with --tree or --servers\n");
+        return 1;
+    }
+    if (gQueueMode && gServers > 1) {
+        fprintf(stderr, "--queue cannot be combined with --servers\n");
+        return 1;
+    }
+    if (gCheck && (gDeadlineMs || gEarly || gCachePath || gRounds != 1 || gServers > 1)) {
+        fprintf(stderr, "--check cannot be combined with --deadline, --early, --cache, --rounds or --servers\n");
+        return 1;
+    }
+    if (gReplayPath && (gDeadlineMs || gEarly || gServers > 1 || gWakeChain || gCheck)) {
+        // порядок там задают дедлайн, шарды или дерево пробуждений — навязать его нельзя
+        fprintf(stderr, "--replay cannot be combined with --deadline, --early, --servers, --wake-chain or --check\n");
+        return 1;
+    }
+    if (gWakeChain && (gWaitMode != WAITMODE_FUTEX || gServers > 1)) {
+        fprintf(stderr, "--wake-chain requires --wait futex and cannot be combined with --servers\n");
+        return 1;
+    }
 
     // лог-файл (если задан)
     if (out_name) {
         gLogFile = fopen(out_name, "w");
         if (!gLogFile) die_errno("fopen(output)");
     }
+    // запись читается до открытия файла новой записи (это может быть тот же файл)
+    if (gReplayPath && !replay_load(gReplayPath)) {
+        fprintf(stderr, "[REPLAY] %s: not a protocol event record\n", gReplayPath);
+        return 1;
+    }
+    if (record_name) {
+        gRecordFile = fopen(record_name, "w");
+        if (!gRecordFile) die_errno("fopen(record)");
+    }
 
-    // настройка SIGINT
-    // цель: корректно завершиться по Ctrl+C (без зависаний потоков)
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = on_sigint;
-    sigemptyset(&sa.sa_mask);
-    if (sigaction(SIGINT, &sa, NULL) != 0) die_errno("sigaction(SIGINT)");
+    int rc;
 
-    // выделяем общую память под предложения/ответы/флаги
-    gOffers = (Offer*)calloc((size_t)gN, sizeof(Offer));
-    gReplies = (Reply*)calloc((size_t)gN, sizeof(Reply));
-    gSubmitted = (atomic_int*)calloc((size_t)gN, sizeof(atomic_int));
-    gReplied = (atomic_int*)calloc((size_t)gN, sizeof(atomic_int));
-    if (!gOffers || !gReplies || !gSubmitted || !gReplied) die_errno("calloc");
+    // настройка SIGINT
+    // цель: корректно завершиться по Ctrl+C (без зависаний потоков);
+    // сигнал блокируется до создания потоков (маску наследуют все) и читается через signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);   // снимок счётчиков — через тот же signalfd
+    rc = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    die_pthread(rc, "pthread_sigmask");
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd < 0) die_errno("signalfd");
+    gStopFd = eventfd(0, EFD_CLOEXEC);
+    gQuitFd = eventfd(0, EFD_CLOEXEC);
+    if (gStopFd < 0 || gQuitFd < 0) die_errno("eventfd");
 
-    // инициализация атомарных флагов
-    for (int i = 0; i < gN; ++i) {
-        atomic_init(&gSubmitted[i], 0);
-        atomic_init(&gReplied[i], 0);
+    if (gPerf) perf_probe();
+    if (gCachePath) cache_open(gCachePath);
+    if (gWaitMode == WAITMODE_FUTEX || gCheck) {
+        futex_probe();
+        if (!gHaveWaitv) {
+            fprintf(stderr, "[WAIT] futex_waitv unavailable, falling back to FUTEX_WAIT "
+                            "(stop noticed within %d ms)\n", FUTEX_FALLBACK_MS);
+        }
     }
-    atomic_init(&gWinnerId, -1);
-    atomic_init(&gBestScore, -1);
-    atomic_init(&gStop, 0);
 
-    safe_print("[MAIN] Старт: N=%d, SEED=%u (Ctrl+C для прерывания)\n", gN, base_seed);
+    // размещение потоков, атрибуты и закрепление памяти — общие для всех раундов
+    init_topology();
+    plan_servers(gServers);
+    init_thread_attrs(&gThreadAttr);
+    if (!gOrderedLog) log_sink_start(thread_attr(&gThreadAttr, -1));
+    if (gMlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) die_errno("mlockall");
+    clock_gettime(CLOCK_MONOTONIC, &gBenchStart);
 
-    // создаём поток сервера (студентка)
-    pthread_t server;
-    int rc = pthread_create(&server, NULL, girl_thread, NULL);
-    die_pthread(rc, "pthread_create(server)");
+    if (gCfgPath && gRounds != 1) watch_config(gCfgPath);
 
-    // создаём N потоков клиентов (поклонники)
-    pthread_t *clients = (pthread_t*)calloc((size_t)gN, sizeof(pthread_t));
-    FanArgs *args = (FanArgs*)calloc((size_t)gN, sizeof(FanArgs));
-    if (!clients || !args) die_errno("calloc(clients/args)");
+    pthread_t stopper;
+    rc = pthread_create(&stopper, thread_attr(&gThreadAttr, -1), shutdown_thread, &sfd);
+    die_pthread(rc, "pthread_create(shutdown)");
 
-    for (int i = 0; i < gN; ++i) {
-        args[i].fan_id = i;
-        args[i].base_seed = base_seed;
-        rc = pthread_create(&clients[i], NULL, fan_thread, &args[i]);
-        die_pthread(rc, "pthread_create(client)");
+    // раунды: новый конфиг (если его перечитали) вступает в силу только здесь,
+    // SEED раунда r — SEED + r - 1, чтобы раунды не повторяли друг друга
+    int played = 0;
+    int check_diffs = 0;
+    if (gCheck) {
+        gThinkUnitMs = 0;
+        gLogLevel = LOG_QUIET;
+        check_diffs = run_check(cfg_name ? gN : check_n, seed);
     }
-
-    // ждём завершения всех клиентов
-    for (int i = 0; i < gN; ++i) {
-        rc = pthread_join(clients[i], NULL);
-        die_pthread(rc, "pthread_join(client)");
+    for (int round = 1; !gCheck && (gRounds == 0 || round <= gRounds) && !atomic_load(&gStop); ++round) {
+        Config next;
+        if (take_pending_config(&next)) {
+            apply_config(&next);
+            seed = next.seed;
+            LOG(LOG_MAIN, "[MAIN] Раунд %d: применён новый конфиг (N=%d, обдумывание %d..%dс, дедлайн %d мс)\n",
+                          round, gN, gThinkMin, gThinkMax, gDeadlineMs);
+        }
+        run_round(round, seed + (unsigned)(round - 1));
+        ++played;
     }
+    pthread_attr_destroy(&gThreadAttr);
 
-    // ждём завершения сервера
-    rc = pthread_join(server, NULL);
-    die_pthread(rc, "pthread_join(server)");
+    // поток завершения: если SIGINT не было — просим его выйти
+    uint64_t one = 1;
+    if (write(gQuitFd, &one, sizeof(one)) != (ssize_t)sizeof(one)) die_errno("write(eventfd)");
+    rc = pthread_join(stopper, NULL);
+    die_pthread(rc, "pthread_join(shutdown)");
+    close(gQuitFd);
+    close(gStopFd);
+    if (gReleaseFd >= 0) close(gReleaseFd);
+    if (gInotifyFd >= 0) close(gInotifyFd);
+    close(sfd);
 
-    // печать итогов
-    int win = atomic_load(&gWinnerId);
-    int best = atomic_load(&gBestScore);
+    if (gRounds != 1) {
+        LOG(LOG_MAIN, "[MAIN] Раундов сыграно: %d\n", played);
+        log_flush();
+    }
+    log_sink_stop();   // сток допечатывает всё до итогов в stderr и закрытия лог-файла
 
-    if (atomic_load(&gStop)) {
-        safe_print("[MAIN] Завершение по SIGINT.\n");
-    } else {
-        safe_print("[MAIN] Итог: победил клиент %02d, best_score=%d\n", win, best);
+    if (gBench) {
+        print_bench();
+        static const char *rng_names[] = { "rand_r", "xoshiro", "pcg" };
+        fprintf(stderr, "[BENCH] rng=%s gen_params=%.3fms rounds=%d\n", rng_names[gRng], gGenMs, played);
+        if (gClosedBy == LATE_EARLY) {
+            fprintf(stderr, "[BENCH] early: decided_at=%.3fs released=%d\n",
+                    elapsed_sec(&gBenchStart, &gDecidedAt), gLateCount);
+        }
+        if (atomic_load(&gStop)) {
+            fprintf(stderr, "[BENCH] sigint_to_join=%.3fms\n", elapsed_sec(&gSigintAt, &gJoinedAt) * 1e3);
+        }
+        static const char *wait_names[] = { "spin", "futex" };
+        int woken = atomic_load(&gWakeCount);
+        fprintf(stderr, "[BENCH] wait=%s%s wake_latency: replies=%d avg=%.1fus max=%.1fus\n",
+                wait_names[gWaitMode], gWaitMode == WAITMODE_FUTEX && !gHaveWaitv ? "(fallback)" : "",
+                woken, woken ? (double)atomic_load(&gWakeNsSum) / woken / 1e3 : 0.0,
+                (double)atomic_load(&gWakeNsMax) / 1e3);
+        if (gFanoutRounds) {
+            char mode[24] = "serial";
+            if (gWakeChain) snprintf(mode, sizeof(mode), "chain(K=%d)", gWakeChain);
+            fprintf(stderr, "[BENCH] reply fan-out: mode=%s rounds=%d first_wake_to_last_reply avg=%.1fus\n",
+                    mode, gFanoutRounds, (double)gFanoutNsSum / gFanoutRounds / 1e3);
+        }
+    }
+
+    if (gRecordFile) {
+        fprintf(stderr, "[RECORD] %s: rounds=%d events=%d\n", record_name, played, gRecWritten);
+        fclose(gRecordFile);
     }
+    if (gReplayPath) {
+        fprintf(stderr, "[REPLAY] %s: recorded_rounds=%d forced_rounds=%d\n", gReplayPath, gReplayCount, gReplayForced);
+        for (int r = 0; r < gReplayCount; ++r) {
+            free(gReplayRounds[r].submit);
+            free(gReplayRounds[r].wake);
+        }
+        free(gReplayRounds);
+        free(gReplaySubmitPos);
+        free(gReplayWakePos);
+    }
+    free(gRecEvents);
+
+    // итоговые счётчики (все потоки уже завершены)
+    if (gPerf) perf_report();
+    if (gStatsSummary) write_stats(stderr, 0);
+    if (gMetricsPath) dump_stats();
 
     // освобождение ресурсов
-    free(args);
-    free(clients);
-    free(gReplied);
-    free(gSubmitted);
-    free(gReplies);
-    free(gOffers);
+    free(gCpus);
+    free(gCpuNode);
+    free(gCpuReserved);
+    arena_free(&gArena);
+    cache_close();
 
     if (gLogFile) fclose(gLogFile);
 
-    return 0;
+    return gCacheDrift || check_diffs ? 3 : 0;
 }
\ No newline at end of file
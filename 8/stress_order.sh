@@ -0,0 +1,90 @@
+#!/bin/sh
+# Стресс-проверка профиля --order acqrel (раздел 30 README).
+# Сборка с ThreadSanitizer и прогоны протокола во всех режимах на малых и больших N,
+# по несколько раундов подряд и без пауз на обдумывание (--think-unit 0), чтобы
+# публикации и опросы флагов шли вплотную. Прогон считается упавшим, если:
+#  - ThreadSanitizer нашёл гонку;
+#  - программа завершилась с ненулевым кодом;
+#  - итоги раундов с --order acqrel не совпали с тем же прогоном в --order seqcst.
+#
+# Запуск из любого каталога: sh 8/stress_order.sh
+# Параметры окружения: SEEDS (число SEED на ячейку, по умолчанию 3), NS (список N),
+# CC (компилятор, по умолчанию gcc), KEEP=1 — не удалять каталог со сборкой и логами.
+
+cd "$(dirname "$0")" || exit 1
+SEEDS=${SEEDS:-3}
+NS=${NS:-"1 2 7 64 200"}
+CC=${CC:-gcc}
+WORK=$(mktemp -d) || exit 1
+BIN="$WORK/main_tsan"
+
+# отдельные барьеры ThreadSanitizer не моделирует: в этой сборке опрос идёт
+# acquire-загрузкой (POLL_ORDER в main.c), пары release/acquire те же
+$CC -std=c17 -O1 -g -fsanitize=thread -pthread main.c -o "$BIN" || exit 1
+export TSAN_OPTIONS="halt_on_error=1 exitcode=66 $TSAN_OPTIONS"
+
+# режимы протокола, где --order меняет упорядочивание публикаций и опросов (по строке)
+MODES="plain
+--tree 4
+--tree 8
+--servers 4
+--launchers 4
+--servers 3 --launchers 2
+--queue
+--wait futex
+--wait futex --wake-chain 4"
+
+# код выхода и итоговые строки раундов (победитель и best_score)
+play() {
+    "$BIN" "$@" --think-unit 0 --rounds 3 --log summary >"$WORK/out" 2>"$WORK/err"
+    echo "rc=$?"
+    grep "Итог" "$WORK/out"
+}
+
+runs=0
+failures=0
+nl='
+'
+IFS=$nl
+for mode in $MODES; do
+    IFS=' '
+    flags=$mode
+    [ "$mode" = plain ] && flags=""
+    servers=$(echo "$flags" | sed -n 's/.*--servers \([0-9]*\).*/\1/p')
+    for n in $NS; do
+        [ -n "$servers" ] && [ "$n" -lt "$servers" ] && continue   # шардов не больше N
+        s=1
+        while [ "$s" -le "$SEEDS" ]; do
+            # shellcheck disable=SC2086 # flags — несколько ключей
+            ref=$(play -n "$n" -s "$s" $flags --order seqcst)
+            cp "$WORK/err" "$WORK/err_ref"
+            # shellcheck disable=SC2086
+            got=$(play -n "$n" -s "$s" $flags --order acqrel)
+            runs=$((runs + 2))
+
+            status=""
+            if grep -q ThreadSanitizer "$WORK/err_ref" "$WORK/err"; then
+                status="data race"
+            elif [ "${ref%%"$nl"*}" != rc=0 ] || [ "${got%%"$nl"*}" != rc=0 ]; then
+                status="seqcst ${ref%%"$nl"*}, acqrel ${got%%"$nl"*}"
+            elif [ "$ref" != "$got" ]; then
+                status="acqrel result differs from seqcst"
+            fi
+            if [ -n "$status" ]; then
+                failures=$((failures + 1))
+                echo "[STRESS] FAIL mode=$mode N=$n SEED=$s: $status"
+                cat "$WORK/err_ref" "$WORK/err" > "$WORK/fail_$failures.log"
+            fi
+            s=$((s + 1))
+        done
+    done
+    echo "[STRESS] mode=$mode done"
+done
+
+echo "[STRESS] runs=$runs failures=$failures"
+if [ "$failures" -ne 0 ] || [ "${KEEP:-0}" = 1 ]; then
+    echo "[STRESS] build and failure logs kept in $WORK"
+else
+    rm -rf "$WORK"
+fi
+[ "$failures" -eq 0 ]
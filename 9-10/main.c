@@ -1,12 +1,26 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #define MAX_TEXT 128
 
@@ -22,31 +36,104 @@ typedef struct {
     int accepted;              // 1 = да, 0 = нет
     int winner_id;             // кто победил
     int best_score;            // лучший балл
+    int late;                  // приём закрыт раньше: LATE_DEADLINE или LATE_EARLY
 } Reply;
 
+struct Sim;
+struct Pipeline;
 
-static int gN = 0;             // количество поклонников
-static Offer *gOffers = NULL;  // массив предложений
-static Reply *gReplies = NULL; // массив ответов
+typedef struct {
+    struct Sim *sim;           // прогон, которому принадлежит поклонник
+    struct Pipeline *pipe;     // конвейер (--pipeline), иначе NULL
+    int fan_id;
+    unsigned seed;
+} FanArgs;
 
 /*
+ * Состояние одного прогона. Все потоки прогона получают указатель на свой Sim,
+ * поэтому несколько прогонов могут идти в одном процессе одновременно (--sweep).
+ * Глобальными остались только настройки командной строки/конфига, счётчики и вывод.
+ *
  * В отличие от версии на 8 баллов, здесь НЕТ активного ожидания.
  * Используются условные переменные:
  *
- *  - gAllSubmitted  — все поклонники отправили предложения
- *  - gRepliesReady  — студентка разослала ответы
+ *  - all_submitted  — все поклонники отправили предложения
+ *  - replies_cond   — студентка разослала ответы
+ *  - stop_cond      — SIGINT или досрочное решение (прерывает обдумывание)
+ */
+typedef struct Sim {
+    // параметры (не меняются, пока идут потоки прогона)
+    int n;                     // количество поклонников
+    int think_min, think_max;  // обдумывание, в единицах think_unit_ms
+    int think_unit_ms;         // 1000 = секунды; 0 = без пауз
+    int deadline_ms;           // 0 = ждать всех
+    int early;                 // EARLY_*
+    int quiet;                 // строки прогона не печатаются (свип)
+
+    // массивы на n поклонников; ёмкость cap сохраняется между прогонами
+    int cap;
+    Offer *offers;
+    Reply *replies;
+    char *arrived;             // arrived[i] = 1, если предложение i успело
+    pthread_t *clients;
+    FanArgs *args;
+
+    pthread_mutex_t lock;
+    pthread_cond_t all_submitted;   // часы CLOCK_MONOTONIC (см. sim_init)
+    pthread_cond_t replies_cond;
+    pthread_cond_t stop_cond;       // часы CLOCK_MONOTONIC
+
+    int submitted_cnt;         // сколько поклонников отправили валентинки
+    int replies_ready;         // ответы готовы
+    int winner_id;
+    int best_score;
+    int stop;                  // прогон прерван по SIGINT
+    int closed;                // приём закрыт: LATE_DEADLINE или LATE_EARLY
+    int late_count;            // сколько поклонников опоздали
+    int early_id;              // первый поклонник, отправивший SCORE_MAX
+    int round;                 // конвейер: раунд, под который открыто это поколение
+    int consumed;              // конвейер: сколько поклонников прочитали ответ
+
+    struct timespec joined_at; // все потоки прогона завершены
+    struct Sim *next;          // список идущих прогонов (для SIGINT)
+} Sim;
+
+static int gN = 0;             // количество поклонников (из -n или конфига)
+
+/*
+ * Сбор с дедлайном (--deadline MS): студентка ждёт all_submitted не дольше MS мс
+ * (pthread_cond_timedwait), затем под lock закрывает приём и выбирает среди
+ * пришедших. Опоздавший поклонник видит closed под тем же мьютексом и сразу
+ * получает ответ "слишком поздно" — победитель к этому моменту уже известен.
+ */
+static int gDeadlineMs = 0;    // 0 = ждать всех
+
+/*
+ * Досрочное решение (--early first|lowest): поклонник с максимальным score будит
+ * студентку, та закрывает приём так же, как по дедлайну, и будит ещё думающих
+ * через stop_cond. first — побеждает первый пришедший с максимумом,
+ * lowest — наименьший id среди пришедших.
  */
+#define SCORE_MIN 1
+#define SCORE_MAX 100
 
-static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  gAllSubmitted = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t  gRepliesReady = PTHREAD_COND_INITIALIZER;
+enum { EARLY_OFF = 0, EARLY_FIRST, EARLY_LOWEST };
+enum { LATE_DEADLINE = 1, LATE_EARLY = 2 };   // причина закрытия приёма (Reply.late)
 
-static int submitted_cnt = 0;  // сколько поклонников отправили валентинки
-static int replies_ready = 0;  // ответы готовы
+static int gEarly = EARLY_OFF;
 
-static int gWinnerId  = -1;
-static int gBestScore = -1;
-static int gStop      = 0;     // флаг завершения по SIGINT
+/*
+ * Завершение по Ctrl+C без обработчика сигнала:
+ * SIGINT заблокирован во всех потоках и читается через signalfd отдельным
+ * потоком завершения — он под мьютексом каждого идущего прогона выставляет
+ * stop и будит всех. Обдумывание — ожидание на stop_cond с таймаутом,
+ * поэтому прерывается сразу.
+ */
+static pthread_mutex_t gSimsLock = PTHREAD_MUTEX_INITIALIZER;
+static Sim *gActiveSims = NULL;             // идущие прогоны (под gSimsLock)
+static int gInterrupted = 0;                // SIGINT получен (под gSimsLock)
+static int gQuitFd = -1;                    // eventfd: main просит поток завершения выйти
+static struct timespec gSigintAt;           // момент получения SIGINT
 
 
 // мьютекс для синхронизации печати
@@ -55,6 +142,104 @@ static pthread_mutex_t gPrintLock = PTHREAD_MUTEX_INITIALIZER;
 // файл для логирования (8+ баллов)
 static FILE *gLogFile = NULL;
 
+/*
+ * Атрибуты потоков (--stack, --guard, --mlock):
+ * поклонникам хватает нескольких КиБ стека, а стек по умолчанию (обычно 8 МиБ)
+ * на 1000 потоков резервирует ~8 ГиБ виртуальной памяти
+ */
+#define DEFAULT_STACK_KB 64
+
+static size_t gStackKb = DEFAULT_STACK_KB;  // 0 = системный размер
+static long gGuardKb = -1;                  // -1 = системный размер
+static int gMlock = 0;
+static int gBench = 0;                      // сводка по памяти и времени в stderr
+
+/*
+ * Счётчики выполнения (--stats, --metrics FILE, снимок по SIGUSR1):
+ * атомарные relaxed-инкременты без мьютекса, каждый счётчик на своей кэш-линии.
+ * Активного ожидания здесь нет, поэтому вместо spins/yields — ожидания на condvar.
+ */
+typedef struct {
+    _Alignas(64) atomic_ullong submitted;    // отправлено предложений
+    _Alignas(64) atomic_ullong replied;      // получено ответов
+    _Alignas(64) atomic_ullong cond_waits;   // ожиданий на условных переменных (в т.ч. с таймаутом)
+    _Alignas(64) atomic_ullong log_lines;    // строк лога
+    _Alignas(64) atomic_ullong snapshots;    // снимков по SIGUSR1
+    _Alignas(64) atomic_ullong rounds;       // сыгранных раундов (и сценариев свипа)
+    _Alignas(64) atomic_ullong reloads;      // принятых перечитываний конфига
+} Stats;
+
+static Stats gStats;
+static atomic_int gStatsN = 0;               // N текущего раунда (меняется между раундами)
+static int gStatsSummary = 0;                // --stats
+static const char *gMetricsPath = NULL;      // --metrics FILE
+static struct timespec gStartAt;             // начало прогона (для uptime)
+
+/*
+ * Конфигурация (-c FILE): N=, SEED=, THINK_MIN=, THINK_MAX=, DEADLINE_MS=, LOG_LEVEL=.
+ * С --rounds файл отслеживается через inotify в потоке завершения; новая
+ * конфигурация откладывается и применяется main только между раундами.
+ */
+#define THINK_LIMIT 60
+
+// LOG_LEVEL / --log: ничего, main, + сервер, + поклонники, + отладка; уровни выше
+// LOG_MAX_LEVEL вырезаются при сборке, выключенный уровень не вычисляет аргументы
+enum { LOG_QUIET = -1, LOG_MAIN = 0, LOG_SERVER, LOG_FANS, LOG_DEBUG };
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 3                      // LOG_DEBUG
+#endif
+#define LOG_ON(lvl) ((lvl) <= LOG_MAX_LEVEL && (lvl) <= gLogLevel)
+#define LOG(lvl, ...) do { if (LOG_ON(lvl)) safe_print(__VA_ARGS__); } while (0)
+// строка потока прогона s (в свипе прогоны молчат)
+#define SIM_LOG(lvl, s, ...) do { if (LOG_ON(lvl) && !(s)->quiet) safe_print(__VA_ARGS__); } while (0)
+
+typedef struct {
+    int n;
+    unsigned seed;
+    int think_min, think_max;    // время обдумывания, с
+    int deadline_ms;
+    int log_level;
+} Config;
+
+static int gRounds = 1;                      // --rounds R: 0 = до SIGINT
+static int gThinkMin = 1;
+static int gThinkMax = 3;
+static int gLogLevel = LOG_FANS;
+static const char *gCfgPath = NULL;
+static Config gBaseCfg;                      // значения из командной строки
+static int gInotifyFd = -1;
+static pthread_mutex_t gCfgLock = PTHREAD_MUTEX_INITIALIZER;
+static Config gPendingCfg;                   // перечитанный конфиг (под gCfgLock)
+static int gCfgPending = 0;
+
+/*
+ * Свип (--sweep K): сценарии (N, SEED) для SEED из [SEED, SEED + K) и N из [N, HI]
+ * (--sweep-n HI) идут в одном процессе на пуле из --jobs J рабочих потоков.
+ * У каждого рабочего свой Sim; следующий сценарий берётся атомарным счётчиком.
+ * Строки прогонов не печатаются, итог — одна таблица в порядке сценариев.
+ */
+typedef struct {
+    int n;
+    unsigned seed;
+    int done;                  // 0 — сценарий не сыгран (SIGINT)
+    int winner_id, best_score;
+    int late_count;
+    double wall_ms;
+    int cached;                // итог взят из кэша (--cache)
+    uint64_t digest;           // --check: дайджест ответов всем поклонникам
+} SweepResult;
+
+static int gSweep = 0;                       // --sweep K: число SEED на каждое N
+static int gSweepNHi = 0;                    // --sweep-n HI: верхняя граница N (0 = только N)
+static int gJobs = 0;                        // --jobs J: 0 = по числу доступных ядер
+static int gThinkUnitMs = -1;                // --think-unit MS: -1 = 1000, в свипе 0
+static atomic_int gSweepNext = 0;
+
+static void stat_inc(atomic_ullong *c) {
+    atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+}
+
 static void die_errno(const char *where) {
     fprintf(stderr, "error at %s: %s\n", where, strerror(errno));
     exit(1);
@@ -66,28 +251,347 @@ static void die_pthread(int rc, const char *where) {
     exit(1);
 }
 
+/*
+ * Сток лога: поток прогона под gPrintLock только копирует формат и сырые
+ * аргументы (строки %s — копией) в общий буфер, а форматирует и пишет в консоль
+ * и лог-файл отдельный поток-сток. Буферов два: пока сток печатает один, потоки
+ * дописывают другой. Порядок строк — порядок взятия мьютекса. Сток забирает
+ * буфер, когда в нём LOG_SINK_BATCH строк или когда с первой строки прошло
+ * LOG_SINK_DELAY_MS (а также по запросу log_sink_drain и при остановке).
+ */
+#define LOG_SINK_BATCH 256
+#define LOG_SINK_DELAY_MS 2
+#define LOG_LINE_MAX 1024                    // длиннее — обрезается с меткой LOG_TRUNC_MARK
+#define LOG_TRUNC_MARK " [...]\n"
+
+typedef union {
+    long long i;                 // %d, %u, %c (со знаком или без — по спецификатору)
+    double f;                    // %f
+    size_t s;                    // %s: смещение копии в text
+} LogArg;
+
+typedef struct {
+    const char *fmt;
+    size_t arg;                  // первый аргумент строки в args
+} LogEntry;
+
+typedef struct {
+    char *text;                  // копии строковых аргументов
+    size_t text_len, text_cap;
+    LogArg *args;
+    size_t args_len, args_cap;
+    LogEntry *ent;
+    size_t count, cap;
+} LogBuf;
+
+static LogBuf gSinkBuf;                      // строки, ещё не взятые стоком (под gPrintLock)
+static pthread_cond_t gSinkCv;               // строки, полная пачка, сброс или стоп (CLOCK_MONOTONIC)
+static pthread_cond_t gSinkIdleCv = PTHREAD_COND_INITIALIZER;   // сток допечатал пачку
+static int gSinkOn = 0;                      // сток принимает строки (под gPrintLock)
+static int gSinkBusy = 0;                    // сток печатает пачку (под gPrintLock)
+static int gSinkFlush = 0;                   // log_sink_drain ждёт: пачку не копить
+static int gSinkStop = 0;
+static pthread_t gSinkThread;
+
+static void *xrealloc(void *p, size_t size) {
+    void *q = realloc(p, size);
+    if (!q) die_errno("realloc(log)");
+    return q;
+}
+
+static void *log_grow(void *p, size_t *cap, size_t need, size_t elem, size_t first) {
+    if (need <= *cap) return p;
+    size_t c = *cap ? *cap : first;
+    while (c < need) c *= 2;
+    *cap = c;
+    return xrealloc(p, c * elem);
+}
+
+// разбор спецификатора после '%': флаги, ширина, точность, длина (h, l, ll, z);
+// возвращает указатель за ним, в *conv — символ преобразования, в *lng — число 'l' (z = 1)
+static const char *log_spec(const char *p, char *conv, int *lng) {
+    while (*p && strchr("-+ #0", *p)) ++p;
+    while (*p >= '0' && *p <= '9') ++p;
+    if (*p == '.') {
+        ++p;
+        while (*p >= '0' && *p <= '9') ++p;
+    }
+    *lng = 0;
+    while (*p == 'h' || *p == 'l' || *p == 'z') {
+        if (*p != 'h') ++*lng;
+        ++p;
+    }
+    *conv = *p;
+    return *p ? p + 1 : p;
+}
+
+// строка в буфер b без форматирования
+static void log_capture(LogBuf *b, const char *fmt, va_list ap) {
+    b->ent = (LogEntry*)log_grow(b->ent, &b->cap, b->count + 1, sizeof(LogEntry), 16);
+    b->ent[b->count++] = (LogEntry){ fmt, b->args_len };
+
+    for (const char *p = fmt; (p = strchr(p, '%')) != NULL;) {
+        char conv;
+        int lng;
+        p = log_spec(p + 1, &conv, &lng);
+        if (conv == '%' || !conv) continue;
+
+        b->args = (LogArg*)log_grow(b->args, &b->args_cap, b->args_len + 1, sizeof(LogArg), 64);
+        LogArg *a = &b->args[b->args_len++];
+        if (conv == 's') {
+            const char *str = va_arg(ap, const char*);
+            size_t len = strlen(str) + 1;
+            b->text = (char*)log_grow(b->text, &b->text_cap, b->text_len + len, 1, 4096);
+            memcpy(b->text + b->text_len, str, len);
+            a->s = b->text_len;
+            b->text_len += len;
+        } else if (strchr("feg", conv)) {
+            a->f = va_arg(ap, double);
+        } else if (strchr("uxX", conv)) {
+            a->i = (long long)(lng >= 2 ? va_arg(ap, unsigned long long) :
+                               lng == 1 ? va_arg(ap, unsigned long) : va_arg(ap, unsigned));
+        } else {
+            a->i = lng >= 2 ? va_arg(ap, long long) : lng == 1 ? va_arg(ap, long) : va_arg(ap, int);
+        }
+    }
+}
+
+// строка не влезла в cap байт: хвост (по границе символа UTF-8) — метка обрезки
+static size_t log_truncated(char *line, size_t cap) {
+    size_t at = cap - sizeof(LOG_TRUNC_MARK);
+    while (at > 0 && ((unsigned char)line[at] & 0xC0) == 0x80) --at;
+    memcpy(line + at, LOG_TRUNC_MARK, sizeof(LOG_TRUNC_MARK));
+    return at + sizeof(LOG_TRUNC_MARK) - 1;
+}
+
+// форматирование строки из буфера (в стоке); возвращает длину
+static size_t log_render(const LogBuf *b, const LogEntry *e, char *out, size_t cap) {
+    size_t n = 0;
+    int cut = 0;
+    const LogArg *a = b->args ? &b->args[e->arg] : NULL;
+    for (const char *p = e->fmt; *p;) {
+        if (n + 1 >= cap) {
+            cut = 1;
+            break;
+        }
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        char conv, spec[16];
+        int lng;
+        const char *end = log_spec(p + 1, &conv, &lng);
+        size_t sl = (size_t)(end - p) < sizeof(spec) ? (size_t)(end - p) : sizeof(spec) - 1;
+        memcpy(spec, p, sl);
+        spec[sl] = '\0';
+        p = end;
+
+        int w;
+        if (conv == '%') w = snprintf(out + n, cap - n, "%%");
+        else if (!conv) break;
+        else if (conv == 's') w = snprintf(out + n, cap - n, spec, b->text + (a++)->s);
+        else if (strchr("feg", conv)) w = snprintf(out + n, cap - n, spec, (a++)->f);
+        else if (lng >= 2) w = snprintf(out + n, cap - n, spec, (a++)->i);
+        else if (lng == 1) w = snprintf(out + n, cap - n, spec, (long)(a++)->i);
+        else w = snprintf(out + n, cap - n, spec, (int)(a++)->i);
+        if (w > 0 && (size_t)w >= cap - n) {
+            cut = 1;
+            break;
+        }
+        if (w > 0) n += (size_t)w;
+    }
+    if (cut) return log_truncated(out, cap);
+    out[n] = '\0';
+    return n;
+}
+
+static void *log_sink_thread(void *arg) {
+    (void)arg;
+    LogBuf batch = { 0 };
+    char line[LOG_LINE_MAX];
+    pthread_mutex_lock(&gPrintLock);
+    for (;;) {
+        while (!gSinkBuf.count && !gSinkStop) pthread_cond_wait(&gSinkCv, &gPrintLock);
+        if (!gSinkBuf.count) break;
+
+        // копим пачку: до LOG_SINK_BATCH строк, но не дольше LOG_SINK_DELAY_MS
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_nsec += LOG_SINK_DELAY_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (gSinkBuf.count < LOG_SINK_BATCH && !gSinkFlush && !gSinkStop) {
+            if (pthread_cond_timedwait(&gSinkCv, &gPrintLock, &until) == ETIMEDOUT) break;
+        }
+
+        // забираем накопленное, потокам — пустой буфер прошлой пачки
+        LogBuf t = gSinkBuf;
+        gSinkBuf = batch;
+        batch = t;
+        gSinkBusy = 1;
+        pthread_mutex_unlock(&gPrintLock);
+
+        for (size_t k = 0; k < batch.count; ++k) {
+            size_t len = log_render(&batch, &batch.ent[k], line, sizeof(line));
+            fwrite(line, 1, len, stdout);
+            if (gLogFile) fwrite(line, 1, len, gLogFile);
+        }
+        fflush(stdout);
+        if (gLogFile) fflush(gLogFile);
+        batch.count = batch.args_len = batch.text_len = 0;
+
+        pthread_mutex_lock(&gPrintLock);
+        gSinkBusy = 0;
+        pthread_cond_broadcast(&gSinkIdleCv);
+    }
+    pthread_mutex_unlock(&gPrintLock);
+    free(batch.text);
+    free(batch.args);
+    free(batch.ent);
+    return NULL;
+}
+
+// остановка стока при взятом gPrintLock (отпускает его): сток допечатывает буфер и выходит
+static void log_sink_stop_locked(void) {
+    int on = gSinkOn;
+    gSinkOn = 0;
+    gSinkStop = 1;
+    pthread_cond_broadcast(&gSinkCv);
+    pthread_mutex_unlock(&gPrintLock);
+    if (!on || pthread_equal(pthread_self(), gSinkThread)) return;
+
+    die_pthread(pthread_join(gSinkThread, NULL), "pthread_join(log sink)");
+    free(gSinkBuf.text);
+    free(gSinkBuf.args);
+    free(gSinkBuf.ent);
+    memset(&gSinkBuf, 0, sizeof(gSinkBuf));
+}
+
+static void log_sink_stop(void) {
+    pthread_mutex_lock(&gPrintLock);
+    log_sink_stop_locked();
+}
+
+// при exit(): он мог прийти из-под gPrintLock (die_errno в log_capture),
+// а мьютекс не рекурсивный — занят он, значит сток не ждём и буфер теряем
+static void log_sink_atexit(void) {
+    if (pthread_mutex_trylock(&gPrintLock) != 0) return;
+    log_sink_stop_locked();
+}
+
+static void log_sink_start(const pthread_attr_t *attr) {
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    die_pthread(pthread_cond_init(&gSinkCv, &cattr), "pthread_cond_init(log sink)");
+    pthread_condattr_destroy(&cattr);
+
+    die_pthread(pthread_create(&gSinkThread, attr, log_sink_thread, NULL), "pthread_create(log sink)");
+    gSinkOn = 1;
+    if (atexit(log_sink_atexit) != 0) die_errno("atexit(log sink)");
+}
+
+// дождаться, пока сток напечатает уже принятые строки (перед итогами в stderr)
+static void log_sink_drain(void) {
+    pthread_mutex_lock(&gPrintLock);
+    gSinkFlush = 1;
+    pthread_cond_broadcast(&gSinkCv);
+    while (gSinkOn && (gSinkBuf.count || gSinkBusy)) pthread_cond_wait(&gSinkIdleCv, &gPrintLock);
+    gSinkFlush = 0;
+    pthread_mutex_unlock(&gPrintLock);
+}
+
 /*
  * Безопасный вывод:
  *  - в консоль
  *  - в лог-файл (если задан)
+ * Форматирует сток; без стока (до его запуска и после exit()) — сам вызывающий.
  */
 static void safe_print(const char *fmt, ...) {
     va_list ap;
     pthread_mutex_lock(&gPrintLock);
+    if (gSinkOn) {
+        va_start(ap, fmt);
+        log_capture(&gSinkBuf, fmt, ap);
+        va_end(ap);
+        if (gSinkBuf.count == 1 || gSinkBuf.count == LOG_SINK_BATCH) pthread_cond_signal(&gSinkCv);
+        pthread_mutex_unlock(&gPrintLock);
+        stat_inc(&gStats.log_lines);
+        return;
+    }
+    pthread_mutex_unlock(&gPrintLock);
 
+    char line[LOG_LINE_MAX];
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
     va_end(ap);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = (int)log_truncated(line, sizeof(line));
 
+    pthread_mutex_lock(&gPrintLock);
+    fwrite(line, 1, (size_t)len, stdout);
     if (gLogFile) {
-        va_start(ap, fmt);
-        vfprintf(gLogFile, fmt, ap);
-        va_end(ap);
+        fwrite(line, 1, (size_t)len, gLogFile);
         fflush(gLogFile);
     }
-
     fflush(stdout);
     pthread_mutex_unlock(&gPrintLock);
+    stat_inc(&gStats.log_lines);
+}
+
+// снимок счётчиков: текст Prometheus (prom = 1) или одна строка для stderr
+static void write_stats(FILE *f, int prom) {
+    static const struct { const char *name, *help; size_t off; } kCounters[] = {
+        { "submitted",  "Offers submitted by fans",         offsetof(Stats, submitted) },
+        { "replied",    "Replies received by fans",         offsetof(Stats, replied) },
+        { "cond_waits", "Condition variable waits",         offsetof(Stats, cond_waits) },
+        { "log_lines",  "Log lines emitted",                offsetof(Stats, log_lines) },
+        { "snapshots",  "Snapshots requested with SIGUSR1", offsetof(Stats, snapshots) },
+        { "rounds",     "Rounds played",                    offsetof(Stats, rounds) },
+        { "reloads",    "Config reloads accepted",          offsetof(Stats, reloads) },
+    };
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double uptime = (double)(now.tv_sec - gStartAt.tv_sec) +
+                    (double)(now.tv_nsec - gStartAt.tv_nsec) / 1e9;
+
+    int n = atomic_load_explicit(&gStatsN, memory_order_relaxed);
+    if (!prom) fprintf(f, "[STATS] uptime=%.3fs N=%d", uptime, n);
+    for (size_t k = 0; k < sizeof(kCounters) / sizeof(kCounters[0]); ++k) {
+        unsigned long long v = atomic_load_explicit(
+            (atomic_ullong*)((char*)&gStats + kCounters[k].off), memory_order_relaxed);
+        if (prom)
+            fprintf(f, "# HELP valentine_%s_total %s.\n# TYPE valentine_%s_total counter\n"
+                       "valentine_%s_total %llu\n",
+                    kCounters[k].name, kCounters[k].help, kCounters[k].name, kCounters[k].name, v);
+        else
+            fprintf(f, " %s=%llu", kCounters[k].name, v);
+    }
+    if (prom) {
+        fprintf(f, "# HELP valentine_fans Number of fan threads.\n# TYPE valentine_fans gauge\n"
+                   "valentine_fans %d\n", n);
+        fprintf(f, "# HELP valentine_uptime_seconds Time since threads were started.\n"
+                   "# TYPE valentine_uptime_seconds gauge\nvalentine_uptime_seconds %.3f\n", uptime);
+    } else {
+        fprintf(f, "\n");
+    }
+}
+
+// снимок в файл метрик (временный файл + rename) или в stderr
+static void dump_stats(void) {
+    if (!gMetricsPath) {
+        write_stats(stderr, 0);
+        return;
+    }
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", gMetricsPath);
+    FILE *f = fopen(tmp, "w");
+    if (!f) die_errno("fopen(metrics)");
+    write_stats(f, 1);
+    if (fclose(f) != 0) die_errno("fclose(metrics)");
+    if (rename(tmp, gMetricsPath) != 0) die_errno("rename(metrics)");
 }
 
 // генерация случайного числа в диапазоне
@@ -96,45 +600,250 @@ static int rand_between(unsigned *seed, int lo, int hi) {
     return lo + (int)(rand_r(seed) % (unsigned)(hi - lo + 1));
 }
 
+static int read_config(const char *fname, Config *c) {
+    FILE *f = fopen(fname, "r");
+    if (!f) return 0;
+
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "N=%d", &c->n) == 1) continue;
+        if (sscanf(line, "SEED=%u", &c->seed) == 1) continue;
+        if (sscanf(line, "THINK_MIN=%d", &c->think_min) == 1) continue;
+        if (sscanf(line, "THINK_MAX=%d", &c->think_max) == 1) continue;
+        if (sscanf(line, "DEADLINE_MS=%d", &c->deadline_ms) == 1) continue;
+        if (sscanf(line, "LOG_LEVEL=%d", &c->log_level) == 1) continue;
+    }
+    fclose(f);
+    return 1;
+}
+
+// NULL — конфигурация годится, иначе текст ошибки
+static const char *config_error(const Config *c) {
+    if (c->n < 1 || c->n > 1000) return "Invalid N";
+    if (c->deadline_ms < 0) return "Invalid deadline";
+    if (c->think_min < 0 || c->think_min > c->think_max || c->think_max > THINK_LIMIT)
+        return "Invalid think range";
+    if (c->log_level < LOG_QUIET || c->log_level > LOG_DEBUG) return "Invalid log level";
+    return NULL;
+}
+
+// только между раундами (потоков раунда нет)
+static void apply_config(const Config *c) {
+    gN = c->n;
+    gThinkMin = c->think_min;
+    gThinkMax = c->think_max;
+    gDeadlineMs = c->deadline_ms;
+    gLogLevel = c->log_level;
+    atomic_store_explicit(&gStatsN, gN, memory_order_relaxed);
+}
+
+// событие inotify по каталогу конфига: перечитываем, если оно про наш файл
+static void config_reload(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(gInotifyFd, buf, sizeof(buf));
+    if (len <= 0) return;
+
+    const char *name = strrchr(gCfgPath, '/');
+    name = name ? name + 1 : gCfgPath;
+    int ours = 0;
+    for (char *p = buf; p < buf + len;) {
+        const struct inotify_event *ev = (const struct inotify_event*)p;
+        if (ev->len && !strcmp(ev->name, name)) ours = 1;
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+    if (!ours) return;
+
+    Config c = gBaseCfg;
+    const char *err = read_config(gCfgPath, &c) ? config_error(&c) : strerror(errno);
+    if (err) {
+        fprintf(stderr, "[CONFIG] %s: %s, keeping previous settings\n", gCfgPath, err);
+        return;
+    }
+    pthread_mutex_lock(&gCfgLock);
+    gPendingCfg = c;
+    gCfgPending = 1;
+    pthread_mutex_unlock(&gCfgLock);
+    stat_inc(&gStats.reloads);
+    fprintf(stderr, "[CONFIG] reloaded %s: N=%d SEED=%u think=%d..%ds deadline_ms=%d log_level=%d "
+                    "(applies from the next round)\n",
+            gCfgPath, c.n, c.seed, c.think_min, c.think_max, c.deadline_ms, c.log_level);
+}
+
+// наблюдение за каталогом (а не файлом): переживает сохранение через rename
+static void watch_config(const char *path) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+
+    gInotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (gInotifyFd < 0) die_errno("inotify_init1");
+    if (inotify_add_watch(gInotifyFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) die_errno("inotify_add_watch");
+}
+
+
+// SIGINT для прогона s: выставить stop и разбудить все его ожидания
+static void sim_stop(Sim *s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->all_submitted);
+    pthread_cond_broadcast(&s->replies_cond);
+    pthread_cond_broadcast(&s->stop_cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// получен ли SIGINT (main и рабочие свипа проверяют перед следующим прогоном)
+static int interrupted(void) {
+    pthread_mutex_lock(&gSimsLock);
+    int stop = gInterrupted;
+    pthread_mutex_unlock(&gSimsLock);
+    return stop;
+}
+
 /*
- * Обработчик Ctrl+C:
- * просто выставляем флаг и будим все ожидающие потоки
+ * Поток завершения: ждёт SIGINT (через signalfd) или просьбу main выйти.
+ * В отличие от обработчика сигнала, здесь можно брать мьютекс и будить
+ * все ожидающие потоки. SIGUSR1 приходит в тот же signalfd: пишем снимок
+ * счётчиков и ждём дальше. С --rounds здесь же разбираются события inotify.
  */
-static void on_sigint(int signo) {
-    (void)signo;
-    pthread_mutex_lock(&gLock);
-    gStop = 1;
-    pthread_cond_broadcast(&gAllSubmitted);
-    pthread_cond_broadcast(&gRepliesReady);
-    pthread_mutex_unlock(&gLock);
+static void *shutdown_thread(void *arg) {
+    int sfd = *(int*)arg;
+    struct pollfd fds[3] = {
+        { .fd = sfd,        .events = POLLIN },
+        { .fd = gQuitFd,    .events = POLLIN },
+        { .fd = gInotifyFd, .events = POLLIN },   // -1 poll пропускает
+    };
+
+    struct signalfd_siginfo si;
+    for (;;) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            die_errno("poll(shutdown)");
+        }
+        if (fds[1].revents & POLLIN) return NULL;
+        if (fds[2].revents & POLLIN) config_reload();
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        if (read(sfd, &si, sizeof(si)) != (ssize_t)sizeof(si)) die_errno("read(signalfd)");
+        if (si.ssi_signo != SIGUSR1) break;
+        stat_inc(&gStats.snapshots);
+        dump_stats();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &gSigintAt);
+
+    // порядок блокировок: gSimsLock, затем lock прогона
+    pthread_mutex_lock(&gSimsLock);
+    gInterrupted = 1;
+    for (Sim *s = gActiveSims; s; s = s->next) sim_stop(s);
+    pthread_mutex_unlock(&gSimsLock);
+    return NULL;
 }
 
-typedef struct {
-    int fan_id;
-    unsigned seed;
-} FanArgs;
+static void sim_init(Sim *s) {
+    memset(s, 0, sizeof(*s));
+    s->think_unit_ms = 1000;
 
-static void *fan_thread(void *arg) {
-    FanArgs *a = (FanArgs*)arg;
-    int id = a->fan_id;
-    unsigned seed = a->seed;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->stop_cond, &cattr);
+    pthread_cond_init(&s->all_submitted, &cattr);
+    pthread_condattr_destroy(&cattr);
+    pthread_cond_init(&s->replies_cond, NULL);
+}
 
-    // имитация "размышлений"
-    int think = rand_between(&seed, 1, 3);
-    for (int i = 0; i < think; ++i) {
-        sleep(1);
-        if (gStop) {
-            safe_print("[Клиент %02d] Прервано (SIGINT) во время обдумывания.\n", id);
-            return NULL;
-        }
+static void sim_destroy(Sim *s) {
+    free(s->clients);
+    free(s->args);
+    free(s->arrived);
+    free(s->replies);
+    free(s->offers);
+    pthread_cond_destroy(&s->stop_cond);
+    pthread_cond_destroy(&s->all_submitted);
+    pthread_cond_destroy(&s->replies_cond);
+    pthread_mutex_destroy(&s->lock);
+}
+
+/*
+ * Подготовка прогона на n поклонников. Массивы переживают прогоны и растут
+ * только когда n больше прежней ёмкости; иначе их достаточно обнулить.
+ * Параметры из настроек копируются сюда — потоки прогона читают только Sim.
+ */
+static void sim_prepare(Sim *s, int n, unsigned seed) {
+    if (n > s->cap) {
+        free(s->offers);
+        free(s->replies);
+        free(s->arrived);
+        free(s->clients);
+        free(s->args);
+        s->offers = calloc(n, sizeof(Offer));
+        s->replies = calloc(n, sizeof(Reply));
+        s->arrived = calloc(n, 1);
+        s->clients = calloc(n, sizeof(pthread_t));
+        s->args = calloc(n, sizeof(FanArgs));
+        if (!s->offers || !s->replies || !s->arrived || !s->clients || !s->args) die_errno("calloc");
+        s->cap = n;
+    } else {
+        memset(s->offers, 0, (size_t)n * sizeof(Offer));
+        memset(s->replies, 0, (size_t)n * sizeof(Reply));
+        memset(s->arrived, 0, (size_t)n);
     }
 
-    // формируем предложение
-    Offer offer;
-    offer.fan_id = id;
-    offer.score = rand_between(&seed, 1, 100);
+    s->n = n;
+    s->think_min = gThinkMin;
+    s->think_max = gThinkMax;
+    s->deadline_ms = gDeadlineMs;
+    s->early = gEarly;
+    for (int i = 0; i < n; ++i) {
+        s->args[i].sim = s;
+        s->args[i].fan_id = i;
+        s->args[i].seed = seed ^ (unsigned)(i * 2654435761u);
+    }
+
+    // итоги прошлого прогона (потоков прогона сейчас нет)
+    s->submitted_cnt = 0;
+    s->replies_ready = 0;
+    s->winner_id = -1;
+    s->best_score = -1;
+    s->stop = 0;
+    s->closed = 0;
+    s->late_count = 0;
+    s->early_id = -1;
+}
+
+/*
+ * "Обдумывание" в течение think единиц с немедленным выходом по SIGINT
+ * (или по досрочному решению — тогда думать уже незачем).
+ * Возвращает 1, если ожидание прервано SIGINT.
+ */
+static int think_wait(Sim *s, int think) {
+    long ms = (long)think * s->think_unit_ms;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
 
-    const char *ideas[] = {
+    pthread_mutex_lock(&s->lock);
+    while (ms > 0 && !s->stop && s->closed != LATE_EARLY) {
+        stat_inc(&gStats.cond_waits);
+        if (pthread_cond_timedwait(&s->stop_cond, &s->lock, &deadline) == ETIMEDOUT) break;
+    }
+    int stopped = s->stop;
+    pthread_mutex_unlock(&s->lock);
+    return stopped;
+}
+
+// предложение поклонника id: score и идея — следующие выборки после обдумывания
+static void make_offer(unsigned *seed, int id, Offer *offer) {
+    static const char *ideas[] = {
         "прогулка по городу + кофе",
         "кино + пицца",
         "ужин при свечах",
@@ -144,109 +853,957 @@ static void *fan_thread(void *arg) {
         "музей + прогулка",
         "концерт + поздний ужин"
     };
-    snprintf(offer.text, sizeof(offer.text), "%s",
-             ideas[rand_between(&seed, 0, 7)]);
+    offer->fan_id = id;
+    offer->score = rand_between(seed, SCORE_MIN, SCORE_MAX);
+    snprintf(offer->text, sizeof(offer->text), "%s", ideas[rand_between(seed, 0, 7)]);
+}
+
+static void *fan_thread(void *arg) {
+    FanArgs *a = (FanArgs*)arg;
+    Sim *s = a->sim;
+    int id = a->fan_id;
+    unsigned seed = a->seed;
+
+    // имитация "размышлений"
+    int think = rand_between(&seed, s->think_min, s->think_max);
+    if (think_wait(s, think)) {
+        SIM_LOG(LOG_FANS, s, "[Клиент %02d] Прервано (SIGINT) во время обдумывания.\n", id);
+        return NULL;
+    }
 
-    pthread_mutex_lock(&gLock);
+    // формируем предложение
+    Offer offer;
+    make_offer(&seed, id, &offer);
+
+    pthread_mutex_lock(&s->lock);
+
+    // приём уже закрыт (дедлайн или досрочное решение) — ответ готов сразу
+    if (s->closed) {
+        s->late_count++;
+        Reply late = { .accepted = 0, .winner_id = s->winner_id, .best_score = s->best_score, .late = s->closed };
+        s->replies[id] = late;
+        pthread_mutex_unlock(&s->lock);
+
+        if (late.late == LATE_EARLY) {
+            SIM_LOG(LOG_FANS, s, "[Клиент %02d] Ответ: Решение принято досрочно — выбран %02d (best_score=%d)\n",
+                              id, late.winner_id, late.best_score);
+            return NULL;
+        }
+        SIM_LOG(LOG_FANS, s, "[Клиент %02d] Опоздал с валентинкой: дедлайн прошёл (думал %dс)\n", id, think);
+        if (late.winner_id < 0) {
+            SIM_LOG(LOG_FANS, s, "[Клиент %02d] Ответ: Слишком поздно — к дедлайну никто не успел\n", id);
+        } else {
+            SIM_LOG(LOG_FANS, s, "[Клиент %02d] Ответ: Слишком поздно — уже выбран %02d (best_score=%d)\n",
+                              id, late.winner_id, late.best_score);
+        }
+        return NULL;
+    }
 
     // отправляем валентинку
-    gOffers[id] = offer;
-    submitted_cnt++;
+    s->offers[id] = offer;
+    s->arrived[id] = 1;
+    stat_inc(&gStats.submitted);
+    s->submitted_cnt++;
 
-    safe_print("[Клиент %02d] Отправил валентинку: score=%d, идея='%s' (думал %dс)\n",
-               id, offer.score, offer.text, think);
+    SIM_LOG(LOG_FANS, s, "[Клиент %02d] Отправил валентинку: score=%d, идея='%s' (думал %dс)\n",
+                      id, offer.score, offer.text, think);
 
     // если это последний поклонник — будим студентку
-    if (submitted_cnt == gN)
-        pthread_cond_signal(&gAllSubmitted);
+    if (s->submitted_cnt == s->n)
+        pthread_cond_signal(&s->all_submitted);
+
+    // максимальный score: заявляемся на досрочное решение
+    if (s->early && offer.score == SCORE_MAX && s->early_id < 0) {
+        s->early_id = id;
+        pthread_cond_signal(&s->all_submitted);
+    }
 
     // ждём ответа студентки
-    while (!replies_ready && !gStop)
-        pthread_cond_wait(&gRepliesReady, &gLock);
+    while (!s->replies_ready && !s->stop) {
+        stat_inc(&gStats.cond_waits);
+        pthread_cond_wait(&s->replies_cond, &s->lock);
+    }
 
-    Reply rep = gReplies[id];
-    pthread_mutex_unlock(&gLock);
+    Reply rep = s->replies[id];
+    int stopped = s->stop;
+    pthread_mutex_unlock(&s->lock);
+    stat_inc(&gStats.replied);
 
-    if (gStop) {
-        safe_print("[Клиент %02d] Ответ: Отказ. (работа остановлена пользователем)\n", id);
+    if (stopped) {
+        SIM_LOG(LOG_FANS, s, "[Клиент %02d] Ответ: Отказ. (работа остановлена пользователем)\n", id);
         return NULL;
     }
 
     if (rep.accepted) {
-        safe_print("[Клиент %02d] Ответ: Принято! (best_score=%d)\n",
-                   id, rep.best_score);
+        SIM_LOG(LOG_FANS, s, "[Клиент %02d] Ответ: Принято! (best_score=%d)\n",
+                          id, rep.best_score);
     } else {
-        safe_print("[Клиент %02d] Ответ: Отказ. Победил %02d (best_score=%d)\n",
-                   id, rep.winner_id, rep.best_score);
+        SIM_LOG(LOG_FANS, s, "[Клиент %02d] Ответ: Отказ. Победил %02d (best_score=%d)\n",
+                          id, rep.winner_id, rep.best_score);
     }
 
     return NULL;
 }
 
 static void *girl_thread(void *arg) {
-    (void)arg;
+    Sim *s = (Sim*)arg;
 
-    pthread_mutex_lock(&gLock);
-    safe_print("[Сервер] Студентка: жду все валентинки...\n");
+    pthread_mutex_lock(&s->lock);
+    SIM_LOG(LOG_SERVER, s, "[Сервер] Студентка: жду все валентинки...\n");
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += s->deadline_ms / 1000;
+    deadline.tv_nsec += (long)(s->deadline_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // ждём, пока все поклонники отправят предложения (или до дедлайна,
+    // или до максимального score)
+    int wakeups = 0;
+    while (s->submitted_cnt < s->n && !s->stop) {
+        if (s->early_id >= 0) {
+            s->closed = LATE_EARLY;
+            pthread_cond_broadcast(&s->stop_cond);   // будим ещё думающих
+            break;
+        }
+        stat_inc(&gStats.cond_waits);
+        ++wakeups;
+        if (!s->deadline_ms) {
+            pthread_cond_wait(&s->all_submitted, &s->lock);
+        } else if (pthread_cond_timedwait(&s->all_submitted, &s->lock, &deadline) == ETIMEDOUT) {
+            s->closed = (s->submitted_cnt < s->n) ? LATE_DEADLINE : 0;
+            break;
+        }
+    }
 
-    // ждём, пока все поклонники отправят предложения
-    while (submitted_cnt < gN && !gStop)
-        pthread_cond_wait(&gAllSubmitted, &gLock);
+    SIM_LOG(LOG_DEBUG, s, "[Сервер] Сбор предложений: %d ожиданий на all_submitted, пришло %d из %d\n",
+                          wakeups, s->submitted_cnt, s->n);
 
     // если пришёл SIGINT — рассылаем отказ
-    if (gStop) {
-        for (int i = 0; i < gN; ++i) {
-            gReplies[i].accepted = 0;
-            gReplies[i].winner_id = -1;
-            gReplies[i].best_score = -1;
-        }
-        replies_ready = 1;
-        pthread_cond_broadcast(&gRepliesReady);
-        pthread_mutex_unlock(&gLock);
+    if (s->stop) {
+        for (int i = 0; i < s->n; ++i) {
+            s->replies[i].accepted = 0;
+            s->replies[i].winner_id = -1;
+            s->replies[i].best_score = -1;
+        }
+        s->replies_ready = 1;
+        pthread_cond_broadcast(&s->replies_cond);
+        pthread_mutex_unlock(&s->lock);
         return NULL;
     }
 
-    // выбор лучшего предложения
-    int best_id = 0;
-    int best_score = gOffers[0].score;
-    for (int i = 1; i < gN; ++i) {
-        if (gOffers[i].score > best_score) {
-            best_score = gOffers[i].score;
+    if (s->closed == LATE_EARLY) {
+        SIM_LOG(LOG_SERVER, s, "[Сервер] Пришло предложение с score=%d — решаю досрочно (пришло %d из %d)\n",
+                            SCORE_MAX, s->submitted_cnt, s->n);
+    } else if (s->closed) {
+        SIM_LOG(LOG_SERVER, s, "[Сервер] Дедлайн %d мс: пришло %d из %d. Выбираю среди пришедших...\n",
+                            s->deadline_ms, s->submitted_cnt, s->n);
+    }
+
+    // выбор лучшего предложения (после дедлайна — только среди успевших)
+    int best_id = -1;
+    int best_score = -1;
+    for (int i = 0; i < s->n; ++i) {
+        if (s->arrived[i] && s->offers[i].score > best_score) {
+            best_score = s->offers[i].score;
             best_id = i;
         }
     }
 
-    gWinnerId = best_id;
-    gBestScore = best_score;
+    // lowest — это и есть обычный выбор (первый с максимумом); first — по заявке
+    if (s->closed == LATE_EARLY && s->early == EARLY_FIRST) {
+        best_id = s->early_id;
+        best_score = SCORE_MAX;
+    }
 
-    safe_print("[Сервер] Выбрано предложение клиента %02d: score=%d, идея='%s'\n",
-               best_id, best_score, gOffers[best_id].text);
+    s->winner_id = best_id;
+    s->best_score = best_score;
+
+    if (best_id >= 0) {
+        SIM_LOG(LOG_SERVER, s, "[Сервер] Выбрано предложение клиента %02d: score=%d, идея='%s'\n",
+                            best_id, best_score, s->offers[best_id].text);
+    } else {
+        SIM_LOG(LOG_SERVER, s, "[Сервер] К дедлайну не пришло ни одной валентинки.\n");
+    }
 
     // рассылка ответов
+    for (int i = 0; i < s->n; ++i) {
+        s->replies[i].accepted = (i == best_id);
+        s->replies[i].winner_id = best_id;
+        s->replies[i].best_score = best_score;
+    }
+
+    s->replies_ready = 1;
+    pthread_cond_broadcast(&s->replies_cond);
+    pthread_mutex_unlock(&s->lock);
+
+    SIM_LOG(LOG_SERVER, s, "[Сервер] Ответы разосланы всем. Завершаю работу.\n");
+    return NULL;
+}
+
+// VSZ/RSS процесса из /proc/self/status
+static void print_mem_usage(const char *when) {
+    long vsz = -1, rss = -1, hwm = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            sscanf(line, "VmSize: %ld", &vsz);
+            sscanf(line, "VmRSS: %ld", &rss);
+            sscanf(line, "VmHWM: %ld", &hwm);
+        }
+        fclose(f);
+    }
+    fprintf(stderr, "[BENCH] %s: vsz=%ldKiB rss=%ldKiB peak_rss=%ldKiB\n", when, vsz, rss, hwm);
+}
+
+/*
+ * Кэш результатов (--cache FILE) — тот же формат файла, что в версии 8,
+ * движок в записи — "9-10". Без дедлайна и досрочного решения итог прогона задан
+ * N, SEED и диапазоном обдумывания. Раунд и каждый сценарий свипа сначала ищутся
+ * в кэше; сыгранные записываются. Поиск и запись в рабочих свипа идут под gCacheLock,
+ * между процессами — под разделяемым (поиск) и исключительным (запись) flock.
+ * --cache-verify K: каждый K-й найденный сценарий играется и сверяется, при дрейфе код выхода 3.
+ */
+#define CACHE_MAGIC 0x31435256u    // "VRC1"
+#define CACHE_SLOTS 4096
+#define CACHE_MAX_N 1000
+#define CACHE_ENGINE "9-10"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t entry_size;
+    uint32_t reserved[13];
+} CacheHeader;
+
+typedef struct {
+    atomic_uint used;                // 1 — запись заполнена (выставляется последним)
+    char engine[12];
+    uint64_t cfg;                    // хеш прочих параметров, влияющих на итог
+    int32_t n;
+    uint32_t seed;
+    int32_t winner_id;
+    int32_t best_score;
+    uint8_t accepted[CACHE_MAX_N];   // ответ каждому поклоннику: 1 — принят
+} CacheEntry;
+
+static const char *gCachePath = NULL;   // --cache FILE
+static int gCacheVerify = 0;            // --cache-verify K: 0 = не сверять
+static int gCacheFd = -1;
+static CacheHeader *gCache = NULL;      // отображение файла: заголовок, затем записи
+static atomic_int gCacheDrift = 0;      // найдено расхождений с кэшем
+static pthread_mutex_t gCacheLock = PTHREAD_MUTEX_INITIALIZER;   // поиск и запись из рабочих свипа
+
+static CacheEntry *cache_slot(uint32_t k) {
+    return (CacheEntry*)((unsigned char*)gCache + sizeof(CacheHeader)) + k;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t len) {
+    const unsigned char *b = (const unsigned char*)p;
+    for (size_t k = 0; k < len; ++k) h = (h ^ b[k]) * 1099511628211ull;
+    return h;
+}
+
+// параметры, от которых зависит итог, кроме N и SEED
+static uint64_t cache_cfg_hash(void) {
+    int v[] = { gThinkMin, gThinkMax };
+    return fnv1a(14695981039346656037ull, v, sizeof(v));
+}
+
+static uint64_t cache_key_hash(uint64_t cfg, int n, unsigned seed) {
+    uint64_t h = fnv1a(14695981039346656037ull, CACHE_ENGINE, sizeof(CACHE_ENGINE));
+    h = fnv1a(h, &cfg, sizeof(cfg));
+    h = fnv1a(h, &n, sizeof(n));
+    return fnv1a(h, &seed, sizeof(seed));
+}
+
+static void cache_open(const char *path) {
+    size_t size = sizeof(CacheHeader) + (size_t)CACHE_SLOTS * sizeof(CacheEntry);
+    gCacheFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (gCacheFd < 0) die_errno("open(cache)");
+    if (flock(gCacheFd, LOCK_EX) != 0) die_errno("flock(cache)");
+    struct stat sb;
+    if (fstat(gCacheFd, &sb) != 0) die_errno("fstat(cache)");
+    int fresh = sb.st_size == 0;
+    if (fresh && ftruncate(gCacheFd, (off_t)size) != 0) die_errno("ftruncate(cache)");
+    if (!fresh && (size_t)sb.st_size != size) {
+        fprintf(stderr, "[CACHE] %s: size mismatch, cache disabled\n", path);
+        close(gCacheFd);
+        gCacheFd = -1;
+        return;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, gCacheFd, 0);
+    if (p == MAP_FAILED) die_errno("mmap(cache)");
+    gCache = (CacheHeader*)p;
+    if (fresh) {
+        gCache->magic = CACHE_MAGIC;
+        gCache->slots = CACHE_SLOTS;
+        gCache->entry_size = sizeof(CacheEntry);
+    } else if (gCache->magic != CACHE_MAGIC || gCache->slots != CACHE_SLOTS ||
+               gCache->entry_size != sizeof(CacheEntry)) {
+        fprintf(stderr, "[CACHE] %s: not a result cache of this format, cache disabled\n", path);
+        munmap(p, size);
+        gCache = NULL;
+    }
+    if (flock(gCacheFd, LOCK_UN) != 0) die_errno("flock(cache)");
+}
+
+static void cache_close(void) {
+    if (gCache) munmap(gCache, sizeof(CacheHeader) + (size_t)CACHE_SLOTS * sizeof(CacheEntry));
+    if (gCacheFd >= 0) close(gCacheFd);
+    gCache = NULL;
+    gCacheFd = -1;
+}
+
+// кэш применим к прогону на n поклонников: итог не зависит от времени
+static int cache_usable(int n) {
+    return gCache && !gDeadlineMs && !gEarly && n <= CACHE_MAX_N;
+}
+
+// поиск записи (копия в *out); 1 — найдена. Как и запись, под gCacheLock (flock
+// одного дескриптора потоки не разделяет) и под разделяемым flock
+static int cache_lookup(int n, unsigned seed, CacheEntry *out) {
+    pthread_mutex_lock(&gCacheLock);
+    if (flock(gCacheFd, LOCK_SH) != 0) die_errno("flock(cache)");
+    uint64_t cfg = cache_cfg_hash();
+    uint32_t k = (uint32_t)(cache_key_hash(cfg, n, seed) % CACHE_SLOTS);
+    int found = 0;
+    for (uint32_t probe = 0; probe < CACHE_SLOTS; ++probe, k = (k + 1) % CACHE_SLOTS) {
+        CacheEntry *e = cache_slot(k);
+        if (!atomic_load_explicit(&e->used, memory_order_acquire)) break;
+        if (e->n == n && e->seed == seed && e->cfg == cfg && !strcmp(e->engine, CACHE_ENGINE)) {
+            memcpy(out, e, sizeof(*out));
+            found = 1;
+            break;
+        }
+    }
+    if (flock(gCacheFd, LOCK_UN) != 0) die_errno("flock(cache)");
+    pthread_mutex_unlock(&gCacheLock);
+    return found;
+}
+
+// запись результата: своя запись перезаписывается, иначе занимается первая свободная
+static void cache_store(const CacheEntry *r) {
+    pthread_mutex_lock(&gCacheLock);
+    if (flock(gCacheFd, LOCK_EX) != 0) die_errno("flock(cache)");
+    uint32_t k = (uint32_t)(cache_key_hash(r->cfg, r->n, r->seed) % CACHE_SLOTS);
+    uint32_t probe = 0;
+    for (; probe < CACHE_SLOTS; ++probe, k = (k + 1) % CACHE_SLOTS) {
+        CacheEntry *e = cache_slot(k);
+        if (!atomic_load_explicit(&e->used, memory_order_acquire)) break;
+        if (e->n == r->n && e->seed == r->seed && e->cfg == r->cfg && !strcmp(e->engine, r->engine)) break;
+    }
+    if (probe == CACHE_SLOTS) {
+        fprintf(stderr, "[CACHE] full (%d entries), result not stored\n", CACHE_SLOTS);
+    } else {
+        CacheEntry *e = cache_slot(k);
+        atomic_store_explicit(&e->used, 0, memory_order_relaxed);
+        memcpy(e->engine, r->engine, sizeof(e->engine));
+        e->cfg = r->cfg;
+        e->n = r->n;
+        e->seed = r->seed;
+        e->winner_id = r->winner_id;
+        e->best_score = r->best_score;
+        memcpy(e->accepted, r->accepted, sizeof(e->accepted));
+        atomic_store_explicit(&e->used, 1, memory_order_release);
+    }
+    if (flock(gCacheFd, LOCK_UN) != 0) die_errno("flock(cache)");
+    pthread_mutex_unlock(&gCacheLock);
+}
+
+// найденный сценарий выбран для сверки (--cache-verify K)
+static int cache_pick_verify(const CacheEntry *e) {
+    return gCacheVerify && cache_key_hash(e->cfg, e->n, e->seed) % (uint64_t)gCacheVerify == 0;
+}
+
+// сверка сыгранного раунда с записью; 1 — совпало
+static int cache_verify(const CacheEntry *want, const CacheEntry *got) {
+    int diff = 0;
+    for (int i = 0; i < got->n; ++i) diff += want->accepted[i] != got->accepted[i];
+    if (!diff && want->winner_id == got->winner_id && want->best_score == got->best_score) {
+        fprintf(stderr, "[CACHE] verified: engine=%s N=%d SEED=%u\n", got->engine, got->n, got->seed);
+        return 1;
+    }
+    fprintf(stderr, "[CACHE] drift: engine=%s N=%d SEED=%u: cached winner=%d best_score=%d, "
+                    "got winner=%d best_score=%d, %d replies differ\n",
+            got->engine, got->n, got->seed, want->winner_id, want->best_score,
+            got->winner_id, got->best_score, diff);
+    atomic_fetch_add(&gCacheDrift, 1);
+    return 0;
+}
+
+// итог сыгранного прогона в виде записи кэша
+static void cache_fill(const Sim *s, unsigned seed, CacheEntry *e) {
+    memset(e, 0, sizeof(*e));
+    snprintf(e->engine, sizeof(e->engine), "%s", CACHE_ENGINE);
+    e->cfg = cache_cfg_hash();
+    e->n = s->n;
+    e->seed = seed;
+    e->winner_id = s->winner_id;
+    e->best_score = s->best_score;
+    for (int i = 0; i < s->n; ++i) e->accepted[i] = (uint8_t)s->replies[i].accepted;
+}
+
+// прогон с кэшем: 1 — итог взят из кэша (*hit), прогон не запускался
+static int cache_try(int n, unsigned seed, CacheEntry *hit, int *verify) {
+    *verify = 0;
+    if (!cache_usable(n) || !cache_lookup(n, seed, hit)) return 0;
+    if (cache_pick_verify(hit)) {
+        *verify = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// после прогона: запись в кэш или сверка с найденной записью
+static void cache_record(const Sim *s, unsigned seed, const CacheEntry *found, int verify) {
+    if (!cache_usable(s->n) || s->stop) return;
+    CacheEntry got;
+    cache_fill(s, seed, &got);
+    if (verify) cache_verify(found, &got);
+    else cache_store(&got);
+}
+
+/*
+ * Сверка режимов (--check): сценарии по сетке N и SEED..SEED+2 играются
+ * прогоном по одному, свипом на пуле и конвейером; ответы всем поклонникам
+ * сводятся к дайджесту FNV-1a — тому же, что печатает --check версии 8,
+ * поэтому таблицы двух версий сравниваются построчно.
+ */
+#define CHECK_SEEDS 3
+
+typedef struct {
+    int32_t accepted, late, winner_id, best_score;   // порядок полей — как в версии 8
+} CheckReply;
+
+static int gCheck = 0;                       // --check
+
+static uint64_t check_digest(const Sim *s) {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < s->n; ++i) {
+        const Reply *r = &s->replies[i];
+        CheckReply c = { r->accepted, r->late, r->winner_id, r->best_score };
+        h = fnv1a(h, &c, sizeof(c));
+    }
+    return h;
+}
+
+/*
+ * Прогон: студентка и n поклонников, ожидание их завершения.
+ * На время прогона Sim стоит в списке идущих, чтобы SIGINT дошёл и до него.
+ */
+static void sim_run(Sim *s, pthread_attr_t *attr) {
+    pthread_mutex_lock(&gSimsLock);
+    if (gInterrupted) s->stop = 1;   // SIGINT пришёл раньше — прогон сразу прерван
+    s->next = gActiveSims;
+    gActiveSims = s;
+    pthread_mutex_unlock(&gSimsLock);
+
+    pthread_t server;
+    die_pthread(pthread_create(&server, attr, girl_thread, s), "pthread_create(server)");
+    for (int i = 0; i < s->n; ++i)
+        die_pthread(pthread_create(&s->clients[i], attr, fan_thread, &s->args[i]), "pthread_create(client)");
+
+    // все потоки запущены и ждут — пик по виртуальной памяти
+    if (gBench && !s->quiet) print_mem_usage("at_launch");
+
+    for (int i = 0; i < s->n; ++i)
+        pthread_join(s->clients[i], NULL);
+    pthread_join(server, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &s->joined_at);
+
+    pthread_mutex_lock(&gSimsLock);
+    Sim **p = &gActiveSims;
+    while (*p != s) p = &(*p)->next;
+    *p = s->next;
+    pthread_mutex_unlock(&gSimsLock);
+    stat_inc(&gStats.rounds);
+}
+
+// атрибуты, общие для всех потоков (настраиваются один раз)
+static void init_thread_attr(pthread_attr_t *attr) {
+    int rc = pthread_attr_init(attr);
+    die_pthread(rc, "pthread_attr_init");
+    if (gStackKb > 0) {
+        rc = pthread_attr_setstacksize(attr, gStackKb * 1024);
+        die_pthread(rc, "pthread_attr_setstacksize");
+    }
+    if (gGuardKb >= 0) {
+        rc = pthread_attr_setguardsize(attr, (size_t)gGuardKb * 1024);
+        die_pthread(rc, "pthread_attr_setguardsize");
+    }
+}
+
+// один раунд обычного режима: прогон с выводом и итог
+static void run_round(Sim *s, pthread_attr_t *attr, unsigned seed) {
+    CacheEntry cached;
+    int verify;
+    if (cache_try(gN, seed, &cached, &verify)) {
+        fprintf(stderr, "[CACHE] hit: engine=%s N=%d SEED=%u\n", CACHE_ENGINE, gN, seed);
+        LOG(LOG_MAIN, "[MAIN] Итог: победил клиент %02d, best_score=%d\n", cached.winner_id, cached.best_score);
+        stat_inc(&gStats.rounds);
+        return;
+    }
+
+    sim_prepare(s, gN, seed);
+    if (gThinkUnitMs >= 0) s->think_unit_ms = gThinkUnitMs;
+    sim_run(s, attr);
+
+    if (s->stop) {
+        LOG(LOG_MAIN, "[MAIN] Завершение по SIGINT.\n");
+    } else {
+        if (s->winner_id >= 0)
+            LOG(LOG_MAIN, "[MAIN] Итог: победил клиент %02d, best_score=%d\n",
+                          s->winner_id, s->best_score);
+        else
+            LOG(LOG_MAIN, "[MAIN] Итог: к дедлайну не успел никто\n");
+        if (s->closed == LATE_EARLY)
+            LOG(LOG_MAIN, "[MAIN] Досрочное решение (score=%d): не дождались %d из %d\n",
+                          SCORE_MAX, s->late_count, s->n);
+        else if (s->deadline_ms)
+            LOG(LOG_MAIN, "[MAIN] Дедлайн %d мс: не успели %d из %d\n", s->deadline_ms, s->late_count, s->n);
+    }
+    cache_record(s, seed, &cached, verify);
+}
+
+/*
+ * Конвейер раундов (--pipeline с --rounds R): потоки живут все R раундов,
+ * а у прогона два поколения — два Sim со своими предложениями, ответами и
+ * мьютексом; раунд r идёт в поколении r % 2. Поклонник, прочитавший ответ
+ * раунда r, сразу думает над раундом r+1, пока медленные ещё читают итоги r.
+ * Студентка держит в работе оба поколения: выбрав в раунде r, она открывает
+ * это поколение под раунд r+2, как только ответ r прочитали все, — и тут же
+ * собирает r+1, который к этому времени уже идёт во втором поколении.
+ * SEED раунда r (с нуля) — SEED + r, как и без конвейера, поэтому итоги совпадают.
+ */
+typedef struct Pipeline {
+    Sim gen[2];
+    int rounds;
+    int *winner_id;            // итоги раундов (заполняет студентка)
+    int *best_score;
+    int played;                // сыграно раундов до SIGINT
+    uint64_t *digest;          // --check: дайджест ответов раунда (NULL — не нужен)
+} Pipeline;
+
+static int gPipeline = 0;                    // --pipeline
+
+// открыть поколение под раунд round: предыдущий раунд в нём прочитан всеми
+static void gen_open(Sim *g, int round) {
+    g->round = round;
+    g->submitted_cnt = 0;
+    g->replies_ready = 0;
+    g->consumed = 0;
+    memset(g->arrived, 0, (size_t)g->n);
+    pthread_cond_broadcast(&g->replies_cond);
+}
+
+static void *pipe_fan_thread(void *arg) {
+    FanArgs *a = (FanArgs*)arg;
+    Pipeline *p = a->pipe;
+    int id = a->fan_id;
+
+    for (int r = 0; r < p->rounds; ++r) {
+        Sim *g = &p->gen[r % 2];
+        unsigned seed = (a->seed + (unsigned)r) ^ (unsigned)(id * 2654435761u);
+
+        // поколение ещё занято раундом r-2 (его дочитывают другие)
+        pthread_mutex_lock(&g->lock);
+        while (g->round != r && !g->stop) {
+            stat_inc(&gStats.cond_waits);
+            pthread_cond_wait(&g->replies_cond, &g->lock);
+        }
+        int stopped = g->stop;
+        pthread_mutex_unlock(&g->lock);
+        if (stopped) return NULL;
+
+        int think = rand_between(&seed, g->think_min, g->think_max);
+        if (think_wait(g, think)) {
+            SIM_LOG(LOG_FANS, g, "[Клиент %02d] Раунд %d: прервано (SIGINT) во время обдумывания.\n", id, r + 1);
+            return NULL;
+        }
+        Offer offer;
+        make_offer(&seed, id, &offer);
+
+        pthread_mutex_lock(&g->lock);
+        g->offers[id] = offer;
+        g->arrived[id] = 1;
+        stat_inc(&gStats.submitted);
+        if (++g->submitted_cnt == g->n) pthread_cond_signal(&g->all_submitted);
+        SIM_LOG(LOG_FANS, g, "[Клиент %02d] Раунд %d: отправил валентинку: score=%d, идея='%s' (думал %dс)\n",
+                          id, r + 1, offer.score, offer.text, think);
+
+        while (!g->replies_ready && !g->stop) {
+            stat_inc(&gStats.cond_waits);
+            pthread_cond_wait(&g->replies_cond, &g->lock);
+        }
+        Reply rep = g->replies[id];
+        stopped = g->stop;
+        // последний прочитавший освобождает поколение под раунд r+2
+        if (++g->consumed == g->n) pthread_cond_signal(&g->all_submitted);
+        pthread_mutex_unlock(&g->lock);
+        stat_inc(&gStats.replied);
+
+        if (stopped) {
+            SIM_LOG(LOG_FANS, g, "[Клиент %02d] Раунд %d: Отказ. (работа остановлена пользователем)\n", id, r + 1);
+            return NULL;
+        }
+        if (rep.accepted) {
+            SIM_LOG(LOG_FANS, g, "[Клиент %02d] Раунд %d: Принято! (best_score=%d)\n", id, r + 1, rep.best_score);
+        } else {
+            SIM_LOG(LOG_FANS, g, "[Клиент %02d] Раунд %d: Отказ. Победил %02d (best_score=%d)\n",
+                              id, r + 1, rep.winner_id, rep.best_score);
+        }
+    }
+    return NULL;
+}
+
+static void *pipe_girl_thread(void *arg) {
+    Pipeline *p = (Pipeline*)arg;
+
+    for (int r = 0; r < p->rounds; ++r) {
+        Sim *g = &p->gen[r % 2];
+        pthread_mutex_lock(&g->lock);
+        while (g->submitted_cnt < g->n && !g->stop) {
+            stat_inc(&gStats.cond_waits);
+            pthread_cond_wait(&g->all_submitted, &g->lock);
+        }
+        if (g->stop) {
+            for (int i = 0; i < g->n; ++i) {
+                g->replies[i].accepted = 0;
+                g->replies[i].winner_id = -1;
+                g->replies[i].best_score = -1;
+            }
+            g->replies_ready = 1;
+            pthread_cond_broadcast(&g->replies_cond);
+            pthread_mutex_unlock(&g->lock);
+            return NULL;
+        }
+
+        int best_id = -1;
+        int best_score = -1;
+        for (int i = 0; i < g->n; ++i) {
+            if (g->offers[i].score > best_score) {
+                best_score = g->offers[i].score;
+                best_id = i;
+            }
+        }
+        for (int i = 0; i < g->n; ++i) {
+            g->replies[i].accepted = (i == best_id);
+            g->replies[i].winner_id = best_id;
+            g->replies[i].best_score = best_score;
+        }
+        g->winner_id = best_id;
+        g->best_score = best_score;
+        g->replies_ready = 1;
+        pthread_cond_broadcast(&g->replies_cond);
+        SIM_LOG(LOG_SERVER, g, "[Сервер] Раунд %d: выбрано предложение клиента %02d: score=%d, идея='%s'\n",
+                            r + 1, best_id, best_score, g->offers[best_id].text);
+        p->winner_id[r] = best_id;
+        p->best_score[r] = best_score;
+        if (p->digest) p->digest[r] = check_digest(g);
+        p->played = r + 1;
+
+        // поколение — под раунд r+2, когда ответ r прочитали все; раунд r+1 тем временем
+        // уже собирается во втором поколении
+        if (r + 2 < p->rounds) {
+            while (g->consumed < g->n && !g->stop) {
+                stat_inc(&gStats.cond_waits);
+                pthread_cond_wait(&g->all_submitted, &g->lock);
+            }
+            if (!g->stop) gen_open(g, r + 2);
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+    return NULL;
+}
+
+// конвейер: оба поколения в списке идущих прогонов (SIGINT), одни потоки на все раунды;
+// out (--check) — итоги раундов с дайджестом ответов
+static int run_pipeline(pthread_attr_t *attr, unsigned seed, SweepResult *out) {
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.rounds = gRounds;
+    p.winner_id = calloc(gRounds, sizeof(int));
+    p.best_score = calloc(gRounds, sizeof(int));
+    p.digest = out ? calloc(gRounds, sizeof(uint64_t)) : NULL;
+    if (!p.winner_id || !p.best_score || (out && !p.digest)) die_errno("calloc(pipeline)");
+    for (int k = 0; k < 2; ++k) {
+        sim_init(&p.gen[k]);
+        sim_prepare(&p.gen[k], gN, seed + (unsigned)k);
+        if (gThinkUnitMs >= 0) p.gen[k].think_unit_ms = gThinkUnitMs;
+        p.gen[k].round = k;
+    }
+    Sim *g0 = &p.gen[0];
     for (int i = 0; i < gN; ++i) {
-        gReplies[i].accepted = (i == best_id);
-        gReplies[i].winner_id = best_id;
-        gReplies[i].best_score = best_score;
+        g0->args[i].sim = g0;
+        g0->args[i].pipe = &p;
+        g0->args[i].seed = seed;     // поклонник сам выводит SEED раунда
     }
 
-    replies_ready = 1;
-    pthread_cond_broadcast(&gRepliesReady);
-    pthread_mutex_unlock(&gLock);
+    pthread_mutex_lock(&gSimsLock);
+    for (int k = 0; k < 2; ++k) {
+        if (gInterrupted) p.gen[k].stop = 1;
+        p.gen[k].next = gActiveSims;
+        gActiveSims = &p.gen[k];
+    }
+    pthread_mutex_unlock(&gSimsLock);
 
-    safe_print("[Сервер] Ответы разосланы всем. Завершаю работу.\n");
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t server;
+    die_pthread(pthread_create(&server, attr, pipe_girl_thread, &p), "pthread_create(server)");
+    for (int i = 0; i < gN; ++i)
+        die_pthread(pthread_create(&g0->clients[i], attr, pipe_fan_thread, &g0->args[i]), "pthread_create(client)");
+    for (int i = 0; i < gN; ++i)
+        pthread_join(g0->clients[i], NULL);
+    pthread_join(server, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_mutex_lock(&gSimsLock);
+    for (int k = 0; k < 2; ++k) {
+        Sim **q = &gActiveSims;
+        while (*q != &p.gen[k]) q = &(*q)->next;
+        *q = p.gen[k].next;
+    }
+    pthread_mutex_unlock(&gSimsLock);
+
+    for (int r = 0; r < p.played; ++r) {
+        stat_inc(&gStats.rounds);
+        LOG(LOG_MAIN, "[MAIN] Раунд %d (SEED=%u): победил клиент %02d, best_score=%d\n",
+                      r + 1, seed + (unsigned)r, p.winner_id[r], p.best_score[r]);
+    }
+    if (p.played < p.rounds) LOG(LOG_MAIN, "[MAIN] Завершение по SIGINT.\n");
+    double wall = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    for (int r = 0; out && r < p.played; ++r) {
+        out[r] = (SweepResult){ .n = gN, .seed = seed + (unsigned)r, .done = 1, .winner_id = p.winner_id[r],
+                                .best_score = p.best_score[r], .wall_ms = wall * 1e3 / p.played, .digest = p.digest[r] };
+    }
+    LOG(LOG_MAIN, "[MAIN] Конвейер: сыграно раундов %d из %d\n", p.played, p.rounds);
+    log_sink_drain();
+    if (gBench) {
+        fprintf(stderr, "[BENCH] pipeline rounds=%d wall=%.3fs (%.1f rounds/s)\n",
+                p.played, wall, wall > 0 ? p.played / wall : 0.0);
+    }
+
+    sim_destroy(&p.gen[0]);
+    sim_destroy(&p.gen[1]);
+    free(p.winner_id);
+    free(p.best_score);
+    free(p.digest);
+    return 0;
+}
+
+typedef struct {
+    pthread_attr_t *attr;
+    SweepResult *res;
+    int total;
+    int n_lo;
+    unsigned seed;
+    const int *grid;           // --check: N сценария k — grid[k / gSweep] (NULL — n_lo + k / gSweep)
+} SweepArgs;
+
+// рабочий свипа: свой Sim на все свои сценарии, сценарии — по атомарному счётчику
+static void *sweep_worker(void *arg) {
+    SweepArgs *a = (SweepArgs*)arg;
+    Sim s;
+    sim_init(&s);
+    s.quiet = 1;
+
+    for (;;) {
+        int k = atomic_fetch_add(&gSweepNext, 1);
+        if (k >= a->total || interrupted()) break;
+
+        SweepResult *r = &a->res[k];
+        r->n = a->grid ? a->grid[k / gSweep] : a->n_lo + k / gSweep;
+        r->seed = a->seed + (unsigned)(k % gSweep);
+
+        CacheEntry cached;
+        int verify;
+        if (cache_try(r->n, r->seed, &cached, &verify)) {
+            r->done = r->cached = 1;
+            r->winner_id = cached.winner_id;
+            r->best_score = cached.best_score;
+            continue;
+        }
+
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        sim_prepare(&s, r->n, r->seed);
+        s.think_unit_ms = gThinkUnitMs >= 0 ? gThinkUnitMs : 0;
+        sim_run(&s, a->attr);
+        if (s.stop) break;
+        cache_record(&s, r->seed, &cached, verify);
+
+        r->done = 1;
+        r->winner_id = s.winner_id;
+        r->best_score = s.best_score;
+        r->late_count = s.late_count;
+        if (gCheck) r->digest = check_digest(&s);
+        r->wall_ms = (double)(s.joined_at.tv_sec - t0.tv_sec) * 1e3 +
+                     (double)(s.joined_at.tv_nsec - t0.tv_nsec) / 1e6;
+    }
+
+    sim_destroy(&s);
     return NULL;
 }
 
-static void read_config(const char *fname, int *N, unsigned *seed) {
-    FILE *f = fopen(fname, "r");
-    if (!f) die_errno("fopen(config)");
+// свип: J рабочих, затем таблица результатов (TSV) в консоль и в -o
+static int run_sweep(pthread_attr_t *attr, unsigned seed) {
+    int n_hi = gSweepNHi ? gSweepNHi : gN;
+    long total = (long)(n_hi - gN + 1) * gSweep;
+    if (total > INT_MAX) {
+        fprintf(stderr, "Too many sweep scenarios\n");
+        return 1;
+    }
 
-    char line[128];
-    while (fgets(line, sizeof(line), f)) {
-        if (sscanf(line, "N=%d", N) == 1) continue;
-        if (sscanf(line, "SEED=%u", seed) == 1) continue;
+    int jobs = gJobs;
+    if (jobs <= 0) {
+        cpu_set_t cpus;
+        jobs = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+    }
+    if (jobs > total) jobs = (int)total;
+
+    SweepArgs args = { attr, calloc(total, sizeof(SweepResult)), (int)total, gN, seed, NULL };
+    pthread_t *workers = calloc(jobs, sizeof(pthread_t));
+    if (!args.res || !workers) die_errno("calloc(sweep)");
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    atomic_store(&gSweepNext, 0);
+    for (int j = 0; j < jobs; ++j)
+        die_pthread(pthread_create(&workers[j], attr, sweep_worker, &args), "pthread_create(sweep)");
+    for (int j = 0; j < jobs; ++j)
+        pthread_join(workers[j], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    int done = 0, cached = 0;
+    safe_print("# N\tSEED\twinner\tbest_score\tlate\twall_ms\tcached\n");
+    for (int k = 0; k < args.total; ++k) {
+        const SweepResult *r = &args.res[k];
+        if (!r->done) continue;
+        ++done;
+        cached += r->cached;
+        safe_print("%d\t%u\t%d\t%d\t%d\t%.3f\t%d\n",
+                   r->n, r->seed, r->winner_id, r->best_score, r->late_count, r->wall_ms, r->cached);
+    }
+    double wall = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    log_sink_drain();
+    fprintf(stderr, "[SWEEP] scenarios=%d/%d cached=%d jobs=%d wall=%.3fs (%.1f scenarios/s)%s\n",
+            done, args.total, cached, jobs, wall, wall > 0 ? done / wall : 0.0,
+            interrupted() ? " interrupted by SIGINT" : "");
+
+    free(workers);
+    free(args.res);
+    return 0;
+}
+
+// один режим сверки по всей сетке: res[k] — сценарий (grid[k / CHECK_SEEDS], SEED + k % CHECK_SEEDS)
+static void check_mode(pthread_attr_t *attr, int mode, const int *grid, int ncount, unsigned seed, SweepResult *res) {
+    int total = ncount * CHECK_SEEDS;
+    if (mode == 0) {
+        // прогоны по одному, в main
+        Sim s;
+        sim_init(&s);
+        s.quiet = 1;
+        for (int k = 0; k < total && !interrupted(); ++k) {
+            SweepResult *r = &res[k];
+            r->n = grid[k / CHECK_SEEDS];
+            r->seed = seed + (unsigned)(k % CHECK_SEEDS);
+            struct timespec t0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            sim_prepare(&s, r->n, r->seed);
+            s.think_unit_ms = 0;
+            sim_run(&s, attr);
+            if (s.stop) break;
+            *r = (SweepResult){ r->n, r->seed, 1, s.winner_id, s.best_score, s.late_count,
+                                (double)(s.joined_at.tv_sec - t0.tv_sec) * 1e3 +
+                                (double)(s.joined_at.tv_nsec - t0.tv_nsec) / 1e6, 0, check_digest(&s) };
+        }
+        sim_destroy(&s);
+    } else if (mode == 1) {
+        // свип: все сценарии сразу на пуле рабочих
+        int jobs = gJobs;
+        if (jobs <= 0) {
+            cpu_set_t cpus;
+            jobs = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+        }
+        if (jobs > total) jobs = total;
+        SweepArgs args = { attr, res, total, 0, seed, grid };
+        pthread_t *workers = calloc(jobs, sizeof(pthread_t));
+        if (!workers) die_errno("calloc(check)");
+        gSweep = CHECK_SEEDS;
+        atomic_store(&gSweepNext, 0);
+        for (int j = 0; j < jobs; ++j)
+            die_pthread(pthread_create(&workers[j], attr, sweep_worker, &args), "pthread_create(check)");
+        for (int j = 0; j < jobs; ++j)
+            pthread_join(workers[j], NULL);
+        gSweep = 0;
+        free(workers);
+    } else {
+        // конвейер: SEED..SEED+2 — три раунда подряд при каждом N
+        gRounds = CHECK_SEEDS;
+        for (int a = 0; a < ncount && !interrupted(); ++a) {
+            gN = grid[a];
+            run_pipeline(attr, seed, &res[a * CHECK_SEEDS]);
+        }
+        gRounds = 1;
     }
-    fclose(f);
+}
+
+// сверка: таблица как у --check версии 8; возвращает число расхождений с прогоном по одному
+static int run_check(pthread_attr_t *attr, int n, unsigned seed) {
+    static const int kGrid[] = { 1, 2, 5, 30, 100, 1000 };
+    static const char *const names[] = { "base", "sweep", "pipeline" };
+    enum { MODES = 3 };
+    const int *grid = n < 0 ? kGrid : &n;
+    int ncount = n < 0 ? (int)(sizeof(kGrid) / sizeof(kGrid[0])) : 1;
+    int total = ncount * CHECK_SEEDS;
+
+    SweepResult *res[MODES];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int m = 0; m < MODES; ++m) {
+        res[m] = calloc(total, sizeof(SweepResult));
+        if (!res[m]) die_errno("calloc(check)");
+        if (!interrupted()) check_mode(attr, m, grid, ncount, seed, res[m]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    int cells = 0, diffs = 0;
+    safe_print("# N\tSEED\tmode\twinner\tbest_score\tdigest\twall_ms\tstatus\n");
+    for (int k = 0; k < total; ++k) {
+        const SweepResult *want = &res[0][k];
+        for (int m = 0; m < MODES; ++m) {
+            const SweepResult *r = &res[m][k];
+            if (!r->done || !want->done) continue;
+            const char *status = "golden";
+            if (m > 0) {
+                int same = r->digest == want->digest && r->winner_id == want->winner_id &&
+                           r->best_score == want->best_score;
+                status = same ? "ok" : "DIFF";
+                if (!same) {
+                    ++diffs;
+                    fprintf(stderr, "[CHECK] mismatch: N=%d SEED=%u mode=%s: winner=%d best_score=%d, "
+                                    "base winner=%d best_score=%d\n",
+                            r->n, r->seed, names[m], r->winner_id, r->best_score, want->winner_id, want->best_score);
+                }
+            }
+            safe_print("%d\t%u\t%s\t%d\t%d\t%016llx\t%.3f\t%s\n", r->n, r->seed, names[m],
+                       r->winner_id, r->best_score, (unsigned long long)r->digest, r->wall_ms, status);
+            ++cells;
+        }
+    }
+    double wall = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    log_sink_drain();
+    fprintf(stderr, "[CHECK] cells=%d modes=%d mismatches=%d wall=%.3fs%s\n", cells, MODES, diffs, wall,
+            interrupted() ? " interrupted by SIGINT" : "");
+    for (int m = 0; m < MODES; ++m)
+        free(res[m]);
+    return diffs;
 }
 
 int main(int argc, char **argv) {
@@ -254,58 +1811,204 @@ int main(int argc, char **argv) {
     unsigned seed = (unsigned)time(NULL);
     const char *cfg = NULL;
     const char *out = NULL;
+    int log_level = LOG_FANS;
+    int seed_set = 0;
 
     // разбор аргументов командной строки
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "-n") && i+1 < argc) N = atoi(argv[++i]);
-        else if (!strcmp(argv[i], "-s") && i+1 < argc) seed = (unsigned)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+            seed = (unsigned)atoi(argv[++i]);
+            seed_set = 1;
+        }
         else if (!strcmp(argv[i], "-c") && i+1 < argc) cfg = argv[++i];
         else if (!strcmp(argv[i], "-o") && i+1 < argc) out = argv[++i];
+        else if (!strcmp(argv[i], "--stack") && i+1 < argc) gStackKb = (size_t)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--guard") && i+1 < argc) gGuardKb = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--mlock")) gMlock = 1;
+        else if (!strcmp(argv[i], "--bench")) gBench = 1;
+        else if (!strcmp(argv[i], "--stats")) gStatsSummary = 1;
+        else if (!strcmp(argv[i], "--metrics") && i+1 < argc) gMetricsPath = argv[++i];
+        else if (!strcmp(argv[i], "--deadline") && i+1 < argc) gDeadlineMs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--rounds") && i+1 < argc) gRounds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--sweep") && i+1 < argc) gSweep = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--sweep-n") && i+1 < argc) gSweepNHi = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--jobs") && i+1 < argc) gJobs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--think-unit") && i+1 < argc) gThinkUnitMs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--pipeline")) gPipeline = 1;
+        else if (!strcmp(argv[i], "--check")) gCheck = 1;
+        else if (!strcmp(argv[i], "--quiet")) log_level = LOG_QUIET;
+        else if (!strcmp(argv[i], "--log") && i+1 < argc) {
+            static const char *const names[] = { "quiet", "summary", "server", "event", "debug" };
+            ++i;
+            log_level = LOG_QUIET - 1;
+            for (int l = LOG_QUIET; l <= LOG_DEBUG; ++l)
+                if (!strcmp(argv[i], names[l - LOG_QUIET])) log_level = l;
+            if (log_level < LOG_QUIET) {
+                fprintf(stderr, "Invalid log level\n");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--cache") && i+1 < argc) gCachePath = argv[++i];
+        else if (!strcmp(argv[i], "--cache-verify") && i+1 < argc) gCacheVerify = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--early") && i+1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "first")) gEarly = EARLY_FIRST;
+            else if (!strcmp(argv[i], "lowest")) gEarly = EARLY_LOWEST;
+            else {
+                fprintf(stderr, "Invalid early mode\n");
+                return 1;
+            }
+        }
     }
 
-    if (cfg) read_config(cfg, &N, &seed);
-    if (N < 1 || N > 1000) {
-        fprintf(stderr, "Invalid N\n");
+    // в сверке сетка N своя (-n сужает её до одного N), SEED по умолчанию — 1
+    int check_n = N;
+    if (gCheck && N < 0 && !cfg) N = 1;
+    if (gCheck && !seed_set) seed = 1;
+
+    Config c = { N, seed, gThinkMin, gThinkMax, gDeadlineMs, log_level };
+    gBaseCfg = c;
+    if (cfg) {
+        if (!read_config(cfg, &c)) die_errno("fopen(config)");
+        gCfgPath = cfg;
+    }
+    const char *err = config_error(&c);
+    if (err) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    if (gRounds < 0) {
+        fprintf(stderr, "Invalid rounds\n");
+        return 1;
+    }
+    if (gSweep < 0 || (gSweepNHi && (gSweepNHi < c.n || gSweepNHi > 1000)) || gJobs < 0 ||
+        gThinkUnitMs < -1 || gThinkUnitMs > 1000) {
+        fprintf(stderr, "Invalid sweep parameters\n");
+        return 1;
+    }
+    if (gPipeline && (gRounds < 1 || gSweep || gDeadlineMs || gEarly)) {
+        fprintf(stderr, "Pipeline needs --rounds R >= 1 and no --sweep, --deadline or --early\n");
+        return 1;
+    }
+    if (gCheck && (gRounds != 1 || gSweep || gPipeline || gDeadlineMs || gEarly || gCachePath)) {
+        fprintf(stderr, "Check needs no --rounds, --sweep, --pipeline, --deadline, --early or --cache\n");
         return 1;
     }
+    if (gCacheVerify < 0) {
+        fprintf(stderr, "Invalid cache verify rate\n");
+        return 1;
+    }
+    apply_config(&c);
+    seed = c.seed;
 
-    gN = N;
+    if (gStackKb > 0 && gStackKb * 1024 < (size_t)PTHREAD_STACK_MIN) {
+        fprintf(stderr, "Invalid stack size\n");
+        return 1;
+    }
 
     if (out) {
         gLogFile = fopen(out, "w");
         if (!gLogFile) die_errno("fopen(output)");
     }
 
-    // обработка SIGINT
-    struct sigaction sa = {0};
-    sa.sa_handler = on_sigint;
-    sigaction(SIGINT, &sa, NULL);
+    // обработка SIGINT: блокируем сигнал до создания потоков (маску наследуют все),
+    // читаем его через signalfd в потоке завершения
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);   // снимок счётчиков — через тот же signalfd
+    die_pthread(pthread_sigmask(SIG_BLOCK, &mask, NULL), "pthread_sigmask");
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd < 0) die_errno("signalfd");
+    gQuitFd = eventfd(0, EFD_CLOEXEC);
+    if (gQuitFd < 0) die_errno("eventfd");
+    if (gCfgPath && gRounds != 1 && !gSweep && !gPipeline) watch_config(gCfgPath);
 
-    gOffers = calloc(gN, sizeof(Offer));
-    gReplies = calloc(gN, sizeof(Reply));
+    if (gMlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) die_errno("mlockall");
+    if (gCachePath) cache_open(gCachePath);
 
-    pthread_t server;
-    pthread_create(&server, NULL, girl_thread, NULL);
+    pthread_attr_t attr;
+    init_thread_attr(&attr);
+    log_sink_start(&attr);
 
-    pthread_t *clients = calloc(gN, sizeof(pthread_t));
-    FanArgs *args = calloc(gN, sizeof(FanArgs));
+    clock_gettime(CLOCK_MONOTONIC, &gStartAt);
 
-    for (int i = 0; i < gN; ++i) {
-        args[i].fan_id = i;
-        args[i].seed = seed ^ (unsigned)(i * 2654435761u);
-        pthread_create(&clients[i], NULL, fan_thread, &args[i]);
+    pthread_t stopper;
+    die_pthread(pthread_create(&stopper, &attr, shutdown_thread, &sfd), "pthread_create(shutdown)");
+
+    int rc = 0;
+    int played = 0;
+    Sim sim;
+    sim_init(&sim);
+    struct timespec rounds_t0, rounds_t1;
+    clock_gettime(CLOCK_MONOTONIC, &rounds_t0);
+    if (gCheck) {
+        gThinkUnitMs = 0;
+        gLogLevel = LOG_QUIET;
+        rc = run_check(&attr, cfg ? gN : check_n, seed) ? 3 : 0;
+    } else if (gSweep) {
+        rc = run_sweep(&attr, seed);
+    } else if (gPipeline) {
+        rc = run_pipeline(&attr, seed, NULL);
+    } else {
+        // раунды: перечитанный конфиг применяется только между ними; SEED раунда r — SEED + r - 1
+        for (int round = 1; (gRounds == 0 || round <= gRounds) && !interrupted(); ++round) {
+            pthread_mutex_lock(&gCfgLock);
+            int pending = gCfgPending;
+            if (pending) c = gPendingCfg;
+            gCfgPending = 0;
+            pthread_mutex_unlock(&gCfgLock);
+
+            if (pending) {
+                apply_config(&c);
+                seed = c.seed;
+                LOG(LOG_MAIN, "[MAIN] Раунд %d: применён новый конфиг (N=%d, обдумывание %d..%dс, дедлайн %d мс)\n",
+                              round, gN, gThinkMin, gThinkMax, gDeadlineMs);
+            }
+            if (gRounds != 1)
+                LOG(LOG_MAIN, "[MAIN] Раунд %d: N=%d, SEED=%u\n", round, gN, seed + (unsigned)(round - 1));
+            run_round(&sim, &attr, seed + (unsigned)(round - 1));
+            ++played;
+        }
     }
+    clock_gettime(CLOCK_MONOTONIC, &rounds_t1);
+    pthread_attr_destroy(&attr);
 
-    for (int i = 0; i < gN; ++i)
-        pthread_join(clients[i], NULL);
-    pthread_join(server, NULL);
+    // поток завершения: если SIGINT не было — просим его выйти
+    uint64_t one = 1;
+    if (write(gQuitFd, &one, sizeof(one)) != (ssize_t)sizeof(one)) die_errno("write(eventfd)");
+    pthread_join(stopper, NULL);
+    close(gQuitFd);
+    if (gInotifyFd >= 0) close(gInotifyFd);
+    close(sfd);
 
-    if (gStop)
-        safe_print("[MAIN] Завершение по SIGINT.\n");
-    else
-        safe_print("[MAIN] Итог: победил клиент %02d, best_score=%d\n",
-                   gWinnerId, gBestScore);
+    if (gRounds != 1 && !gSweep && !gPipeline) LOG(LOG_MAIN, "[MAIN] Раундов сыграно: %d\n", played);
+    log_sink_stop();   // сток допечатывает всё до итогов в stderr и закрытия лог-файла
+
+    if (gBench) {
+        print_mem_usage("at_exit");
+        if (!gSweep && !gPipeline && !gCheck) {
+            double wall = (double)(rounds_t1.tv_sec - rounds_t0.tv_sec) +
+                          (double)(rounds_t1.tv_nsec - rounds_t0.tv_nsec) / 1e9;
+            fprintf(stderr, "[BENCH] rounds=%d wall=%.3fs (%.1f rounds/s)\n",
+                    played, wall, wall > 0 ? played / wall : 0.0);
+        }
+        if (sim.stop) {
+            double ms = (double)(sim.joined_at.tv_sec - gSigintAt.tv_sec) * 1e3 +
+                        (double)(sim.joined_at.tv_nsec - gSigintAt.tv_nsec) / 1e6;
+            fprintf(stderr, "[BENCH] sigint_to_join=%.3fms\n", ms);
+        }
+    }
+
+    // итоговые счётчики (все потоки уже завершены)
+    if (gStatsSummary) write_stats(stderr, 0);
+    if (gMetricsPath) dump_stats();
+
+    sim_destroy(&sim);
+    cache_close();
 
     if (gLogFile) fclose(gLogFile);
-    return 0;
-}
\ No newline at end of file
+    if (rc == 0 && atomic_load(&gCacheDrift)) rc = 3;
+    return rc;
+}